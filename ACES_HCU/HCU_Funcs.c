@@ -10,15 +10,135 @@
  */
 
 
-//! This is so that the delay functions work.  Sets clock to 1MHz
+//! Sets clock to 1MHz
 #define F_CPU 1000000UL   
 #include "HCU_Funcs.h"
 #include <avr/io.h>
-#include <util/delay.h>   // This library is so that easy delay functions can be implemented
 #include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
 #include <float.h>
+#include <string.h>
 
+#if (OS_Bat > 2) || (OS_Hopper > 2) || (OS_ECU > 2) || (OS_FLine1 > 2) || (OS_FLine2 > 2) || (OS_ESB > 2)
+#error "Oversampling is limited to 4^2 samples per channel, anything more won't fit the 12 bit results"
+#endif
 
+//! ADMUX bits for AVCC (5V) as the reference, included in every entry of @c adc_seq
+#define adc_ref (1 << REFS0)
+
+//! ADC scan sequence, one entry per logical sensor in the same order as @c saveTemps.  Switching channels is a single ADMUX write of @c mux.
+//! Each settling conversion costs one more timebase period per scan, but no time in the main loop
+static const adc_chan_t adc_seq[] = {
+	{adc_ref | 0, OS_Bat,    1},    // Battery          ADC0
+	{adc_ref | 2, OS_Hopper, 1},    // Hopper           ADC2
+	{adc_ref | 3, OS_ECU,    1},    // ECU              ADC3
+	{adc_ref | 4, OS_FLine1, 1},    // Fuel Line 1      ADC4
+	{adc_ref | 5, OS_FLine2, 1},    // Fuel Line 2      ADC5
+	{adc_ref | 6, OS_ESB,    1}     // ESB              ADC6
+};
+
+//! Length of the scan, taken straight from the table
+#define adc_seq_len (sizeof(adc_seq) / sizeof(adc_seq[0]))
+
+_Static_assert(adc_seq_len == num_temps, "num_temps has to match the number of entries in adc_seq");
+
+//! Filtering between the ADC and the heaters for each channel, in the same order as @c saveTemps
+static const temp_filt_t temp_filt[num_temps] = {
+	{2, 1},                         // Battery
+	{2, 1},                         // Hopper
+	{2, 1},                         // ECU
+	{2, 1},                         // Fuel Line 1
+	{1, 1},                         // Fuel Line 2, already oversampled so it can follow faster
+	{2, 1}                          // ESB
+};
+
+//! ADC count to deci-degF table, one entry at the start of every segment plus the end point.  Lives in flash
+static const int16_t temp_table[temp_seg_count + 1] PROGMEM = {
+	temp_seg(0),  temp_seg(1),  temp_seg(2),  temp_seg(3),
+	temp_seg(4),  temp_seg(5),  temp_seg(6),  temp_seg(7),
+	temp_seg(8),  temp_seg(9),  temp_seg(10), temp_seg(11),
+	temp_seg(12), temp_seg(13), temp_seg(14), temp_seg(15),
+	temp_seg(16)
+};
+
+//! Dead band below the setpoint in counts, shared by most of the heaters
+#define band_lo band_to_counts(heater_band_lo)
+
+//! Dead band above the setpoint in counts, shared by most of the heaters
+#define band_hi band_to_counts(heater_band_hi)
+
+//! Heater table, one entry per heater.  tempHeaterHelper() runs every entry through the same loop, so a new heater is just a new line.
+//! The ready bits have to be 1 << (row number) for the switch to pumping to work
+static const heater_t heaters[] PROGMEM = {
+	{&PORTD, temp_to_counts(TempBat),    band_lo, 0,       0,                   0,                    0,                   BatPin,    deci_amps(AmpsBat),    watts_to_energy(WattsBat),    {255, 255, 255},                          0, 0x01},   // Lipo batteries, no overshoot allowed
+	{&PORTD, temp_to_counts(TempHopper), band_lo, band_hi, 0,                   0,                    0,                   HopperPin, deci_amps(AmpsHopper), watts_to_energy(WattsHopper), {255, 255, 255},                          1, 0x02},   // Hopper
+	{&PORTB, temp_to_counts(TempECU),    band_lo, band_hi, pid_gain(ECU_kp),    pid_gain_i(ECU_ki),   pid_gain_d(ECU_kd),  ECU_pin,   deci_amps(AmpsECU),    watts_to_energy(WattsECU),    {duty8(ECU_duty), 0, duty8(exh_duty)},    2, 0x04},   // ECU, PI, off while pumping
+	{&PORTD, temp_to_counts(TempFLine1), band_lo, band_hi, 0,                   0,                    0,                   FLine1Pin, deci_amps(AmpsFLine1), watts_to_energy(WattsFLine1), {255, 255, 255},                          3, 0x08},   // Fuel Line 1
+	{&PORTD, temp_to_counts(TempFLine2), band_lo, band_hi, pid_gain(FL2_kp),    pid_gain_i(FL2_ki),   pid_gain_d(FL2_kd),  Fline2Pin, deci_amps(AmpsFLine2), watts_to_energy(WattsFLine2), {duty8(F_line_duty), 0, duty8(exh_duty)}, 4, 0x10},   // Fuel Line 2, PI, off while pumping
+	{&PORTD, temp_to_counts(TempESB),    band_lo, band_hi, 0,                   0,                    0,                   ESB_Pin,   deci_amps(AmpsESB),    watts_to_energy(WattsESB),    {255, 255, 255},                          5, 0x20}    // ESB
+};
+
+_Static_assert(sizeof(heaters) / sizeof(heaters[0]) == num_heaters, "num_heaters has to match the number of entries in heaters");
+
+//! Value of @c desired_temp once every heater has come up to temperature
+#define all_ready ((1 << num_heaters) - 1)
+
+//! Autotune relay dead band in counts
+#define tune_counts band_to_counts(tune_band)
+
+//! Ziegler-Nichols PI proportional gain for a relay test, 0.45 Ku with Ku = 4 d / (pi a), in Q8.  Taking d and a as the
+//! whole output and temperature swings (both twice the amplitude) leaves the same ratio
+#define tune_kp_k ((uint32_t)(0.45 * 4 / 3.14159265 * (1 << pid_q) + 0.5))
+
+//! Ziegler-Nichols PI integral gain for a relay test, 0.45 Ku / (Pu / 1.2), in Q8 per step once divided by the period in steps
+#define tune_ki_k ((uint32_t)(0.54 * 4 / 3.14159265 * (1 << pid_q) + 0.5))
+
+//! Wraps a timer 2 count that has gone at most one period past the end of the software PWM period
+#define pwm_wrap(t) ((uint8_t)(((t) >= pwm_period) ? (t) - pwm_period : (t)))
+
+//! Thermal model sample period in ms
+#define rls_ms ((uint32_t)rls_steps * temp_ticks)
+
+//! @c rls_lambda in Q28
+#define rls_lambda_q28 ((int64_t)(rls_lambda * (1L << 28) + 0.5))
+
+//! 1 / @c rls_lambda in Q16
+#define rls_inv_lambda_q16 ((int64_t)((1L << 16) / rls_lambda + 0.5))
+
+_Static_assert(num_heaters <= rls_steps, "every heater needs its own step out of rls_steps");
+
+//! Lowest and highest believable calibrated counts and the most they can move in a scan, see @c fault_t_min
+#define fault_lo_counts temp_to_counts(fault_t_min)
+#define fault_hi_counts temp_to_counts(fault_t_max)
+#define fault_jump_counts band_to_counts(fault_jump)
+
+//! Control steps in @c fault_off_sec
+#define fault_off_steps ((uint8_t)(fault_off_sec * 1000UL / temp_ticks))
+
+//! @c max_amps in deci-amps
+#define max_deci_amps ((uint16_t)(max_amps * 10 + 0.5))
+
+//! Per-channel calibration kept in EEPROM.  These defaults end up in the .eep file, bench calibration overwrites them through tempCalibrate()
+static temp_cal_t ee_temp_cal[num_temps] EEMEM = {
+	{cal_unity, 0}, {cal_unity, 0}, {cal_unity, 0},
+	{cal_unity, 0}, {cal_unity, 0}, {cal_unity, 0}
+};
+
+
+//! Autotuned controller gains.  Erased (0xFFFF) means the heater hasn't been tuned and runs with the gains in @c heaters
+static pid_gains_t ee_pid_gains[num_heaters] EEMEM = {
+	{0xFFFF, 0xFFFF}, {0xFFFF, 0xFFFF}, {0xFFFF, 0xFFFF},
+	{0xFFFF, 0xFFFF}, {0xFFFF, 0xFFFF}, {0xFFFF, 0xFFFF}
+};
+
+//! Heater energy counters as of the end of the last run, see energySave()
+static uint32_t ee_heater_mJ[3][num_heaters] EEMEM;
+
+//! Set this to 1 on the bench (avrdude or the debugger) and the next boot runs the relay autotune on every closed loop heater.  Cleared once it is done
+static uint8_t ee_autotune EEMEM = 0;
 
 /** @brief Initializes the microcontroller for its mainline execution.
  *
@@ -27,10 +147,11 @@
  *  1) Sets up the port used for the Alive LED to be an output, MOSFET control
  *  ports to be outputs, and the temperature (ADC lines) to be inputs. 0 is input and 1 is output
  *
- *  2) Enables the interrupts for timer1 overflow.  No other interrupts
+ *  2) Starts Timer1 as the system timebase and Timer2 as the software PWM for the heaters, enables the interrupts for timer1 overflow and ADC conversion complete,
+ *     and hooks the ADC up to the timer1 overflow so the temperature scan runs on its own
  *
  *  3) Initializes the global variables defined in the .h to the appropriate values.
- *     i.e. The mode is set to 0 (heating mode)
+ *     i.e. The mode is set to 0 (heating mode).  The temperature calibration is loaded out of EEPROM
  *
  *  @param Void
  *  @return Void
@@ -61,388 +182,1745 @@ void Initial(void)
 	// Configure the ADC
 	ADCSRA |= 1 << ADPS2;   // This is so there is a prescalar of 16.  ADC needs frequency between 50-200kHz so 1,000,000/16 puts it in this range.
 	ADCSRA |= 1 << ADEN;    // Enable the ADC
-	ADMUX |= 1 << REFS0;    // Make AVCC (5V) the reference voltage
+	ADCSRA |= 1 << ADIE;    // Conversions are stepped through by the ADC ISR
+	ADMUX = adc_ref;        // Make AVCC (5V) the reference voltage
+#if !adc_noise_sleep
+	SFIOR = (SFIOR & 0x1F) | (1 << ADTS2) | (1 << ADTS1);   // ADTS = 110, conversions start on the Timer1 overflow
+	ADCSRA |= 1 << ADATE;   // Turn on auto triggering, the CPU never has to start a conversion
+#endif
+	adc_write_buf = 0;
+	scan_complete = 0;
+	filt_primed = 0;
+	pwmPins();   // The ADC ISR needs to know which pins to kill for a bad sensor as soon as it runs
 
 	sei();       // This sets the global interrupt flag to allow for hardware interrupts
 	
-	// Now enable the timer1 for 0.5 sec
-	TIMSK |= 1 << TOIE1;                 // turn on overflow interrupts
-	TCCR1B |= (1<<CS11);                 // This has a prescalar of 8
-	TCNT1 = 3036;                        // This will load the value so that when using a prescalar of 8, it will overflow after 500ms
-	
-	saveTemps[0] = -100.0;        // Assign initial temperature values that for sure will be colder than the specified temps 
-	saveTemps[1] = -100.0;
-	saveTemps[2] = -100.0;
-	saveTemps[3] = -100.0;
-	saveTemps[4] = -100.0;
-	saveTemps[5] = -100.0;
-	saveTemps[6] = -100.0; 
-	
-	// Now I need to turn on all of the heaters as well as set the duty cycles for the PWMs which will be on timers 0 and 2
-	// Start with the PWM for the ECU, this will be on timer0
-	TCNT0 = 0;      // Clear the timer register to make sure I have the full range on the first cycle
-	assign_bit(&TCCR0, WGM01, 1);
-	assign_bit(&TCCR0, WGM00, 1);      // These two set the PWM Mode to "Fast PWM"
-	assign_bit(&TCCR0, COM01, 1); 
-	assign_bit(&TCCR0, COM00, 1);      // These two set the PWM type to inverting PWM
-	
-	OCR0 = 255 - (255*ECU_duty);       // This will set it to the specified duty by the #define
-	
-	TCCR0 |= (1 << CS02);              // This will start the PWM with a duty cycle of 65.536 ms
-	
-	// Now do the PWM for the second fuel line which will use Timer 2,  this will look very similar to the last few lines of code
-	TCNT2 = 0;      // Clear the timer register to make sure I have the full range on the first cycle
-	assign_bit(&TCCR2, WGM21, 1);
-	assign_bit(&TCCR2, WGM20, 1);      // These two set the PWM Mode to "Fast PWM"
-	assign_bit(&TCCR2, COM21, 1);
-	assign_bit(&TCCR2, COM20, 1);      // These two set the PWM type to inverting PWM
-		
-	OCR2 = 255 - (255*F_line_duty);    // This will set it to the specified duty by the #define
-		
-	TCCR2 |= (1 << CS22);              // This will start the PWM with a duty cycle of 65.536 ms, just like before
+	// Now start timer1 as the timebase.  This is Fast PWM mode 14 with ICR1 as TOP and a prescalar of 1, which is
+	// what the pump needs later on.  OC1B stays disconnected until change_timers() hands it to the pump.
+	blink_ticks = 0;
+	alive_counter = 0;
+	sys_ticks = 0;
+	ICR1 = timebase_top;
+	TCCR1A = (1 << WGM11);
+	TCCR1B = (1 << WGM12) | (1 << WGM13);
+	TIMSK |= 1 << TOIE1;                 // turn on overflow interrupts, this also clears TOV1 so each overflow triggers the ADC
+	TCCR1B |= (1 << CS10);               // This has a prescalar of 1
+	
+	eeprom_read_block(temp_cal, ee_temp_cal, sizeof(temp_cal));
+	for (uint8_t i = 0; i < num_temps; i++)
+	{
+		if (temp_cal[i].gain == 0xFFFF)           // EEPROM has been erased, fall back to the plain transfer function
+		{
+			temp_cal[i].gain = cal_unity;
+			temp_cal[i].offset = 0;
+		}
+		rawTemps[i] = 0;          // Assign initial temperature values that for sure will be colder than the specified temps 
+		saveTemps[i] = dF(-100);
+		fault_flags[i] = 0;
+		fault_bad[i] = 0;
+	}
+	
+	fault_any = 0;
+	pwm_kill_d = 0;
+	pwm_kill_b = 0;
+	adcScanStart();               // Point the ADC at the first channel, the timer1 overflow takes it from there
 	
-	// Now turn on all the other heaters
-	assign_bit(&PORTD, BatPin, 1);
-	assign_bit(&PORTD, HopperPin, 1);
-	assign_bit(&PORTD, FLine1Pin, 1);
-	assign_bit(&PORTD, ESB_Pin, 1);     // I can omit doing this for the ECU and FuelLine1
+	// Now I need to turn on all of the heaters at their mode 0 duty, every heater runs off of the software PWM on timer 2
+	heater_state = (1 << num_heaters) - 1;   // Every heater starts out on until the first scan picks the real states
+	heater_seeded = 0;
+	for (uint8_t i = 0; i < num_heaters; i++)
+	{
+		heater_switches[i] = 0;
+		heater_duty[i] = pgm_read_byte(&heaters[i].duty[0]);
+		pid_integ[i] = 0;
+		pid_ff[i] = 0;
+		fault_ref[i] = 0;
+		fault_off[i] = 0;
+		heater_mJ[0][i] = 0;
+		heater_mJ[1][i] = 0;
+		heater_mJ[2][i] = 0;
+		heater_mJ_frac[i] = 0;
+		pid_last[i] = rawTemps[pgm_read_byte(&heaters[i].sensor)];
+		rls_count[i] = 0;
+		rls_u_sum[i] = 0;
+		for (uint8_t r = 0; r < 3; r++)
+			for (uint8_t c = 0; c < 3; c++)
+				rls_P[i][r][c] = (r == c) ? (int32_t)(rls_p0 * (1L << 28)) : 0;
+		rls_theta[i][0] = (int32_t)(64 * 0.99 * 65536L);      // Start off assuming a slow channel with no heater
+		rls_theta[i][1] = 0;
+		rls_theta[i][2] = 0;
+	}
+	rls_step = 0;
+	rls_primed = 0;
+	rls_valid = 0;
+	pid_ff_on = 0;
+	
+	energy_save_pos = sizeof(energy_snap);    // Nothing to save yet
+	eeprom_read_block(pid_gains, ee_pid_gains, sizeof(pid_gains));
+	for (uint8_t i = 0; i < num_heaters; i++)
+	{
+		if (pid_gains[i].kp == 0xFFFF)           // Never been tuned, use the gains that were built in
+		{
+			pid_gains[i].kp = pgm_read_word(&heaters[i].kp);
+			pid_gains[i].ki = pgm_read_word(&heaters[i].ki);
+		}
+	}
+	tune_heater = tune_off;
+	plan_primed = 0;
+	warm_eta = plan_none;
+	if (eeprom_read_byte(&ee_autotune) == 1)
+		tuneNext(0);              // Bench asked for the autotune boot mode
+	pwmInit();
 	output_count = 0;
-	hand_pwm = 7;     // This means that the fuel line 2 will have a 10 percent 
-	pwm_count = 0;
 				
 }
 
-/** @brief Interrupt service routine for the timer which controls the alive LED and warming LED
+/** @brief Interrupt service routine for the timebase, which is the system tick and controls the alive LED and warming LED
+ *
+ *  This performs the following functions:
+ *  
+ *  1) Count up @c sys_ticks, this is what wakes the main loop back up out of sleepIdle()
+ *
+ *  2) Every 50 ms (@c ticks_per_led_step) move the LED patterns on a step.  A whole pattern is 1 sec (@c led_steps).
+ *     Mode 0 toggles the warming LED every 0.5 sec and the alive LED every 1 sec.  While any channel has a fault
+ *     the warming LED toggles every step instead, in every mode.
+ *     Mode 1 has the alive LED on for 0.75 sec and off for 0.25 sec, mode 2 on for 0.1 sec and off for 0.9 sec.
+ *
+ *  3) The reseting of the interrupt flag is cleared automatically (page 113 of data sheet, make sure of this).
+ *     This has to keep happening in every mode since the ADC is triggered off of the flag going high.
+ *
+ *  @param TIMER1_OVF_vect    The interrupt vector for the overflow of timer 1 
+ *  @return Void
+ */
+ISR(TIMER1_OVF_vect)
+{
+	sys_ticks++;
+	if (++blink_ticks < ticks_per_led_step)
+		return;
+	blink_ticks = 0;
+	
+	if (++alive_counter >= led_steps)
+		alive_counter = 0;
+	
+	if (fault_any)
+		PORTB ^= (1 << Warm_LED);                    // Warming LED blinking 10 times a second means a heater has been shut down for a fault
+	
+	if (!opMode)
+	{
+		if (!fault_any && (alive_counter == 0 || alive_counter == (led_steps >> 1)))
+			PORTB ^= (1 << Warm_LED);                // This will have the warming LED blink 0.5 sec on 0.5 sec off
+		if (alive_counter == 0)
+			PORTD ^= (1 << Alive_LED);               // and the alive LED blinking twice as slow
+	}
+	else if (alive_counter == 0)
+		PORTD |= (1 << Alive_LED);                   // Start of the on part of the pattern
+	else if (alive_counter == ((opMode == 1) ? 15 : 2))
+		PORTD &= ~(1 << Alive_LED);                  // 0.75 sec in for mode 1, 0.1 sec in for mode 2
+}
+
+/** @brief Checks if a periodic job is due and moves its schedule on if it is
+ *
+ *  The schedule is kept in phase with the tick (@p last moves by exactly @p period), so jobs run at a
+ *  fixed rate no matter how long the main loop takes.  If the main loop got held up for more than a
+ *  whole period the missed runs are dropped instead of being run back to back.
+ *
+ *  @param[in,out] last Tick the job was last due on
+ *  @param[in] period Number of ticks between runs of the job
+ *  @return 1 if the job should run now, 0 if not
+ */
+uint8_t tickElapsed(uint16_t *last, uint16_t period)
+{
+	uint16_t now;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		now = sys_ticks;             // 16 bit read has to be done with the ISR held off
+	}
+	
+	if ((uint16_t)(now - *last) < period)
+		return 0;
+	
+	*last += period;
+	if ((uint16_t)(now - *last) >= period)
+		*last = now;                 // Fell more than a whole period behind
+	return 1;
+}
+
+/** @brief Puts the CPU in idle sleep until the next interrupt
+ *
+ *  The timers, ADC and INT2 all keep running in idle, and the system tick makes sure this never lasts
+ *  more than one tick.
+ *
+ *  @param void
+ *  @return void
+ */
+void sleepIdle(void)
+{
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_mode();
+}
+
+/** @brief Picks up the latest completed ADC scan, converts it to temperatures, and starts the next scan
+ *
+ *  This performs the following functions:
+ *
+ *  1) Check to see if the ADC ISR has finished a full scan.  If it hasn't then return, there is nothing to wait on.
+ *     With @c adc_noise_sleep the CPU sleeps through the scan here instead.
+ *
+ *  2) Calibrate the six results in the read half and check them with faultCheck(), then filter the good ones and
+ *     save them to @c rawTemps.  Clear @c scan_complete so the ISR can hand over the next scan.  The ISR keeps
+ *     filling the other half of @c adc_results the whole time.
+ *
+ *  3) Call tempHeaterHelper() to act on the new raw counts
+ *
+ *  4) Convert the raw counts into deci-degF and save them to @c saveTemps for telemetry
+ *
+ *  @param void
+ *  @return void
+ *  @see tempHeaterHelper
+ */
+void tempConversion(void)
+{
+#if adc_noise_sleep
+	adcSleepScan();
+#endif
+	if (!scan_complete)
+		return;                     // The ADC is still working on the scan, come back next loop
+	
+	uint8_t read_buf = adc_write_buf ^ 0x01;    // The ISR already swapped halves, so the finished scan is in the other one
+	for (unsigned char i = 0; i < num_temps; i++)
+	{
+		uint16_t counts = tempCalApply(i, adc_results[read_buf][i]);
+		if (!faultCheck(i, counts))
+			rawTemps[i] = tempFilter(i, counts);    // A bad reading doesn't get into the filter, the heater is off anyway
+	}
+	scan_complete = 0;                          // Done with the read half, the ISR can hand over the next scan
+	
+	tempHeaterHelper();
+	
+	for (unsigned char i = 0; i < num_temps; i++)
+		saveTemps[i] = adcToTemp(rawTemps[i]);    // Engineering units are only for looking at, so this is done after the heaters are taken care of
+}
+
+/** @brief Converts a calibrated ADC result into a temperature in deci-degF
+ *
+ *  Looks up the segment of @c temp_table the counts fall in and linearly interpolates
+ *  between its two end points.  That is two flash reads, one multiply and a shift no matter
+ *  how the table is shaped.
+ *
+ *  With the stock straight line table the result is within 1 deci-degF of the float transfer function
+ *  over all 4096 counts (0.96 worst case).  Up to half of that is the table entries being rounded to
+ *  whole deci-degF and the rest is the shift rounding the interpolation down.  The straight line itself
+ *  loses nothing to the 16 segments, only a hand edited nonlinear table would.
+ *
+ *  @param[in] counts Calibrated ADC result, 0 to @c adc_full_scale - 1
+ *  @return Temperature in deci-degF
+ *  @see tempCalApply
+ */
+int16_t adcToTemp(uint16_t counts)
+{
+	uint8_t seg = counts >> temp_seg_shift;
+	int16_t lo = pgm_read_word(&temp_table[seg]);
+	int16_t hi = pgm_read_word(&temp_table[seg + 1]);
+	uint8_t frac = counts & ((1 << temp_seg_shift) - 1);
+	
+	return lo + (int16_t)(((int32_t)(hi - lo) * frac) >> temp_seg_shift);
+}
+
+/** @brief Applies a channel's two point calibration to a raw ADC result
+ *
+ *  The result is in the counts the nominal sensor would have read, so it can be compared
+ *  directly against the @c temp_to_counts setpoints and looked up in @c temp_table.
+ *
+ *  @param[in] channel Temperature channel (index into @c saveTemps)
+ *  @param[in] raw ADC result, 0 to @c adc_full_scale - 1
+ *  @return Calibrated counts, clamped to 0 to @c adc_full_scale - 1
+ */
+uint16_t tempCalApply(uint8_t channel, uint16_t raw)
+{
+	int32_t counts = (((uint32_t)raw * temp_cal[channel].gain + (cal_unity >> 1)) >> 14) + temp_cal[channel].offset;
+	
+	if (counts < 0)
+		return 0;
+	if (counts > adc_full_scale - 1)
+		return adc_full_scale - 1;
+	return (uint16_t)counts;
+}
+
+/** @brief Runs one new sample through a channel's filter stage
+ *
+ *  This performs the following functions:
+ *
+ *  1) If @c temp_filt asks for it, take the median of this sample and the last two.  This is three
+ *     compares and gets rid of single sample spikes without any lag on a steady ramp.
+ *
+ *  2) Run the result through an EMA with a weight of 1/2^ema_shift.  The state is kept scaled up by
+ *     2^ema_shift so the update is one shift, one subtract and one add.
+ *
+ *  On the channel's first good reading (its @c filt_primed bit clear) the history and EMA are loaded straight
+ *  from the sample and the bit gets set.
+ *
+ *  @param[in] channel Temperature channel (index into @c saveTemps)
+ *  @param[in] counts Calibrated ADC result
+ *  @return Filtered counts
+ *  @see tempConversion
+ */
+uint16_t tempFilter(uint8_t channel, uint16_t counts)
+{
+	uint8_t shift = temp_filt[channel].ema_shift;
+	uint16_t *hist = filt_hist[channel];
+	
+	if (!(filt_primed & (1 << channel)))
+	{
+		hist[0] = counts;
+		hist[1] = counts;
+		filt_ema[channel] = counts << shift;
+		filt_primed |= 1 << channel;
+		return counts;
+	}
+	
+	if (temp_filt[channel].median)
+	{
+		uint16_t a = hist[0];
+		uint16_t b = hist[1];
+		hist[0] = b;
+		hist[1] = counts;
+		
+		uint16_t lo = (a < b) ? a : b;
+		uint16_t hi = (a < b) ? b : a;
+		if (counts < lo)
+			counts = lo;
+		else if (counts > hi)
+			counts = hi;              // Clamping the new sample between the other two leaves the median
+	}
+	
+	filt_ema[channel] += counts - (filt_ema[channel] >> shift);
+	return filt_ema[channel] >> shift;
+}
+
+/** @brief Works out a channel's two point calibration and saves it to EEPROM
+ *
+ *  Meant to be called from the debugger on the bench.  Soak the sensor at two known temperatures,
+ *  note the raw ADC result at each (@c adc_results), then pass both pairs in here.
+ *
+ *  @param[in] channel Temperature channel (index into @c saveTemps)
+ *  @param[in] raw1 Raw ADC result at the first reference temperature
+ *  @param[in] temp1 First reference temperature in deci-degF
+ *  @param[in] raw2 Raw ADC result at the second reference temperature
+ *  @param[in] temp2 Second reference temperature in deci-degF
+ *  @return 1 if the calibration was saved, 0 if the two points can't be used
+ */
+uint8_t tempCalibrate(uint8_t channel, uint16_t raw1, int16_t temp1, uint16_t raw2, int16_t temp2)
+{
+	if (channel >= num_temps || raw1 == raw2)
+		return 0;
+	
+	// Counts the nominal sensor would read at each reference temperature, this is the inverse of the transfer function
+	int32_t nom1 = (((int32_t)(temp1 - temp_offset_dF) << 9) + (temp_gain_q9 >> 1)) / temp_gain_q9;
+	int32_t nom2 = (((int32_t)(temp2 - temp_offset_dF) << 9) + (temp_gain_q9 >> 1)) / temp_gain_q9;
+	
+	int32_t gain = ((nom2 - nom1) << 14) / ((int32_t)raw2 - (int32_t)raw1);
+	if (gain <= 0 || gain > 0xFFFE)
+		return 0;                                   // Sensor is backwards or way out of spec
+	
+	temp_cal[channel].gain = (uint16_t)gain;
+	temp_cal[channel].offset = (int16_t)(nom1 - (((uint32_t)raw1 * (uint16_t)gain + (cal_unity >> 1)) >> 14));
+	eeprom_update_block(&temp_cal[channel], &ee_temp_cal[channel], sizeof(temp_cal_t));
+	return 1;
+}
+
+/** @brief Points the ADC at the first temperature channel and resets the scan
+ *
+ *  Only needs to be called once from Initial().  After that the scans wrap around on their own,
+ *  with every conversion started by the timer1 overflow (or by adcSleepScan() with @c adc_noise_sleep).
+ *
+ *  @param void
+ *  @return void
+ *  @see tempConversion
+ */
+void adcScanStart(void)
+{
+	adc_channel = 0;
+	adc_accum = 0;
+	adc_samples = 0;
+	adc_discard = adc_seq[0].settle;
+	ADMUX = adc_seq[0].mux;
+}
+
+/** @brief Sleeps in ADC Noise Reduction mode until the next scan is complete
+ *
+ *  Going into ADC Noise Reduction sleep starts a conversion with the CPU and I/O clocks stopped, and the
+ *  ADC ISR wakes the CPU back up once it is done.  So each trip around the loop is one sample.
+ *  Any other interrupt (INT2, the timers) will also wake it up, in which case it just goes back to sleep
+ *  and the conversion in progress carries on.
+ *
+ *  @note Timers 0, 1 and 2 are stopped while asleep, so the PWMs and the LED timing stretch by the
+ *        length of the scan (roughly 0.2 ms per sample).
+ *
+ *  @param void
+ *  @return void
+ *  @see tempConversion
+ */
+void adcSleepScan(void)
+{
+	set_sleep_mode(SLEEP_MODE_ADC);
+	cli();
+	while (!scan_complete)
+	{
+		sleep_enable();
+		sei();                       // The instruction after sei() always runs, so the ISR can't sneak in before the sleep
+		sleep_cpu();
+		sleep_disable();
+		cli();
+	}
+	sei();
+}
+
+/** @brief Interrupt Service Routine which saves an ADC result and moves the scan to the next channel
+ *
+ *  This performs the following functions:
+ *
+ *  1) Throw the conversion away if it is the settling conversion right after a multiplexer change.  The
+ *     sample-and-hold gets a whole extra timebase period to charge and nothing has to wait on it.
+ *
+ *  2) Perform a 10 bit ADC read and add it to the oversample sum for the current channel
+ *
+ *  3) Once 4^n samples are in (n from @c adc_seq), decimate the sum down to 10 + n bits, scale it
+ *     to @c adc_bits and save it to the write half of @c adc_results.  A result within @c fault_rail of
+ *     either rail trips @c fault_stuck and shuts the channel's heaters off on the spot.
+ *
+ *  4) After the last channel, swap the halves of @c adc_results and raise @c scan_complete for the main loop.
+ *     If the main loop hasn't picked up the last scan yet, the halves stay put and the new scan just replaces the old one.
+ *
+ *  5) Change the multiplexer to the next channel in @c adc_seq, wrapping around to the first, and
+ *     flag the next conversion for the bin if that channel wants to settle
+ *
+ *  Nothing here starts a conversion, the next timer1 overflow does that.
+ *
+ *  @param ADC_vect    The interrupt vector for the completion of an ADC conversion
+ *  @return void
+ *  @see adcScanStart
+ */
+ISR(ADC_vect)
+{
+	if (adc_discard)
+	{
+		adc_discard = 0;                             // Don't even need to read it, ADC keeps going
+		return;
+	}
+	
+	uint8_t low_bits = ADCL;
+	uint8_t high_bits = ADCH;						 // ADCL has to be read first
+	adc_accum += (high_bits << 8) | low_bits;
+	adc_samples++;
+	
+	uint8_t shift = adc_seq[adc_channel].os_shift;
+	if (adc_samples < (1 << (shift << 1)))           // Still waiting on 4^n samples
+		return;
+	
+	uint16_t result = (adc_accum >> shift) << (adc_bits - 10 - shift);
+	adc_results[adc_write_buf][adc_channel] = result;
+	if (result < fault_rail || result >= adc_full_scale - fault_rail)
+	{
+		fault_flags[adc_channel] |= fault_stuck;     // Open or shorted sensor line, its heater goes off right now
+		fault_any |= 1 << adc_channel;
+		pwm_kill_d |= fault_bit_d[adc_channel];
+		pwm_kill_b |= fault_bit_b[adc_channel];
+		PORTD &= ~fault_bit_d[adc_channel];
+		PORTB &= ~fault_bit_b[adc_channel];
+	}
+	adc_accum = 0;
+	adc_samples = 0;
+	adc_channel++;
+	
+	if (adc_channel >= adc_seq_len)
+	{
+		adc_channel = 0;
+		if (!scan_complete)
+		{
+			adc_write_buf ^= 0x01;                   // Hand the finished half over to the main loop
+			scan_complete = 1;
+		}
+	}
+	
+	ADMUX = adc_seq[adc_channel].mux;
+	adc_discard = adc_seq[adc_channel].settle;
+}
+
+/** @brief Checks the recorded temperatures and ensures there is no overheating
+ *
+ *  This performs the following functions:
+ *
+ *  1) Runs every heater in @c heaters through the same loop.  Heaters with gains in the table get their
+ *     duty from heaterPid() and set their ready bit once they reach the setpoint.  The rest are on/off: above
+ *     the setpoint plus @c hyst_hi the heater is turned off and its ready bit is set, below the setpoint minus
+ *     @c hyst_lo it is turned on, and in between it is left alone.  An on/off heater that is on gets the duty
+ *     from its @c heaters entry for the current mode.  On the very first pass an on/off heater in the dead band
+ *     is set by which side of the setpoint it is on instead of keeping the all on state from Initial(), and
+ *     none of the first pass changes count.  After that, every time a heater goes from off to on or back,
+ *     @c heater_switches counts it, and the new duties are handed to the software PWM.  A heater whose sensor
+ *     has a fault stays off and counts as ready, so one dead sensor can't leave the vehicle stuck warming up
+ *     (the warming LED blinks fast the whole time instead).  If the autotune was on it, the autotune skips it.  A heater more than @c fault_over above its
+ *     setpoint whose output has been off for @c fault_off_sec gets watched, and if it climbs another
+ *     @c fault_climb above the coolest it has been since then, it is tripped as a runaway.
+ *
+ *  2) In "keep warm" if temp falls below minimum desired, turn on heater.  If goes above maximum, turn off.
+ *     While warming up, warmPlan() keeps the ETA up to date and picks which heater gets current first, and
+ *     thermalModel() keeps fitting every channel's thermal model the whole time.
+ *  
+ *  3) Once all temperatures have reached their desired temperatures, change the mode to fuel pumping
+ *     and illuminate the warming complete light.  This waits for the autotune to finish if it is running.
+ *
+ *  4) Continue the "keep warm" state after the mode has been changed.
+ *
+ *  @param void
+ *  @return void
+ *  @note Need to confirm that heater operation is still sufficient for phase 1 and 2.
+ *  @see tempConversion
+ */
+void tempHeaterHelper(void)
+{
+	heater_t h;
+	
+	uint8_t mask = 0x01;
+	for (uint8_t i = 0; i < num_heaters; i++, mask <<= 1)
+	{
+		memcpy_P(&h, &heaters[i], sizeof(heater_t));     // One block read out of flash per heater
+		uint16_t temp = rawTemps[h.sensor];
+		uint8_t state = heater_state;
+		
+		if (heater_duty[i])
+			fault_off[i] = 0;
+		else if (fault_off[i] < fault_off_steps)
+			fault_off[i]++;
+		
+		if (temp > h.setpoint + band_to_counts(fault_over) && fault_off[i] >= fault_off_steps)
+		{
+			if (!fault_ref[i] || temp < fault_ref[i])
+				fault_ref[i] = temp;                 // Way too hot with the output off, measure the climb from the coolest it gets
+			else if (temp > fault_ref[i] + band_to_counts(fault_climb))
+				faultTrip(h.sensor, fault_runaway);  // Still climbing with nothing turned on, the switch is stuck
+		}
+		else
+			fault_ref[i] = 0;
+		
+		if (fault_flags[h.sensor])                   // Bad sensor or runaway, this heater stays off
+		{
+			heater_state &= ~mask;
+			heater_duty[i] = 0;
+			desired_temp |= h.ready;                 // and doesn't hold up the warm-up, the warming LED blinking fast says why
+			if (i == tune_heater)
+				tuneNext(i + 1);                     // Can't autotune it either, keeps its gains and the autotune moves on
+		}
+		else if (i == tune_heater)                   // Autotune relay has this one
+		{
+			heater_duty[i] = heaterTune(i, &h, temp);
+		}
+		else if (h.kp | h.ki | h.kd)                 // Closed loop heater, the controller picks the duty
+		{
+			heater_duty[i] = heaterPid(i, &h, temp);
+			if (temp >= h.setpoint)
+				desired_temp |= h.ready;
+			if (heater_duty[i])
+				heater_state |= mask;
+			else
+				heater_state &= ~mask;
+		}
+		else
+		{
+			if (temp > h.setpoint + h.hyst_hi)       // safety first so make sure that the heater always turns off if it is getting too hot
+			{
+				heater_state &= ~mask;
+				desired_temp |= h.ready;
+			}
+			else if (temp + h.hyst_lo < h.setpoint)
+			{
+				heater_state |= mask;
+			}
+			else if (!heater_seeded)                 // First reading is in the dead band, so which side of the setpoint it is on picks
+			{
+				if (temp < h.setpoint)
+					heater_state |= mask;
+				else
+					heater_state &= ~mask;
+			}
+			heater_duty[i] = (heater_state & mask) ? h.duty[(uint8_t)opMode] : 0;
+		}
+		
+		if (((state ^ heater_state) & mask) && heater_seeded && heater_switches[i] != 0xFFFF)
+			heater_switches[i]++;                    // Output changed, count it for the bench
+	}
+	heater_seeded = 1;                               // The first pass sets the states off of real readings, it isn't a switch
+	
+	warmPlan();
+	thermalModel();
+	pwmUpdate();
+	for (uint8_t i = 0; i < num_heaters; i++)
+		rls_u_sum[i] += pwm_len[i];              // The duty that goes out until the next step
+	
+	if (desired_temp == all_ready && tune_heater == tune_off)      // Will go in here every time after it stops being mode 0, but not until the autotune is done
+	{
+		if (!opMode)    // only do this if it has never gone in here before
+			change_timers();                     // New initialization routine which will change the prescalars and such for the timers which will be serving different purposes
+	}
+}
+
+/** @brief Warm-up planner, estimates how long each heater has to go and gives the slowest one priority
+ *
+ *  This performs the following functions:
+ *
+ *  1) Every @c plan_steps control steps, measures how far each heater's temperature has come since last time
+ *     and runs it through an EMA to get a heating rate.
+ *
+ *  2) Divides what each heater still has to go (to the point where its ready bit gets set) by its rate to get
+ *     @c plan_eta in seconds.  A heater that is ready has an ETA of 0, one that isn't heating up is @c plan_none.
+ *     @c warm_eta is the longest of them, since pumping waits on the last heater.
+ *
+ *  3) Puts the heater with the longest ETA in @c plan_first.  pwmUpdate() places its on-window first, so when
+ *     @c max_amps is tight that heater gets its whole duty and the heaters which will be ready sooner anyway
+ *     are the ones that get cut short.  When the budget isn't tight everyone gets everything and this changes
+ *     nothing, which is already the fastest warm-up there is.
+ *
+ *  Once the warm-up is over (mode 1 or 2) or during the autotune the planner stays out of the way.
+ *
+ *  @param void
+ *  @return void
+ *  @see pwmUpdate
+ */
+void warmPlan(void)
+{
+	heater_t h;
+	
+	if (opMode || tune_heater != tune_off)
+	{
+		plan_first = plan_none;
+		warm_eta = 0;
+		plan_primed = 0;
+		return;
+	}
+	
+	if (!plan_primed)                                // First time in, just take the starting temperatures
+	{
+		for (uint8_t i = 0; i < num_heaters; i++)
+		{
+			plan_last[i] = rawTemps[pgm_read_byte(&heaters[i].sensor)];
+			plan_rate[i] = 0;
+			plan_eta[i] = plan_none;
+		}
+		plan_count = 0;
+		plan_primed = 1;
+		warm_eta = plan_none;
+		plan_first = plan_none;
+		return;
+	}
+	if (++plan_count < plan_steps)
+		return;
+	plan_count = 0;
+	if (plan_primed < 255)
+		plan_primed++;
+	
+	uint16_t slowest = 0;
+	plan_first = plan_none;
+	warm_eta = 0;
+	for (uint8_t i = 0; i < num_heaters; i++)
+	{
+		memcpy_P(&h, &heaters[i], sizeof(heater_t));
+		uint16_t temp = rawTemps[h.sensor];
+		
+		int32_t rise = (int32_t)((int16_t)temp - (int16_t)plan_last[i]) << 4;
+		plan_rate[i] += rise - (plan_rate[i] >> plan_ema_shift);
+		plan_last[i] = temp;
+		
+		uint16_t target = h.setpoint + ((h.kp | h.ki | h.kd) ? 0 : h.hyst_hi);
+		int32_t rate = plan_rate[i] >> plan_ema_shift;
+		if (desired_temp & h.ready)
+			plan_eta[i] = 0;
+		else if (temp >= target)
+			plan_eta[i] = 1;                         // Ready bit goes on next step
+		else if (rate <= 0 || plan_primed <= (1 << plan_ema_shift))
+			plan_eta[i] = plan_none;                 // Not heating up, or the EMA hasn't settled yet
+		else
+		{
+			uint32_t eta = (((uint32_t)(target - temp) << 4) * (plan_steps * temp_ticks) / rate + 500) / 1000;
+			plan_eta[i] = (eta >= plan_none) ? plan_none - 1 : eta;
+		}
+		
+		if (plan_eta[i] > warm_eta)
+			warm_eta = plan_eta[i];
+		if (plan_eta[i] && plan_eta[i] >= slowest)
+		{
+			slowest = plan_eta[i];
+			plan_first = i;
+		}
+	}
+}
+
+/** @brief Checks one channel of a new scan for a bad sensor
+ *
+ *  This performs the following functions:
+ *
+ *  1) Out of range: the calibrated reading has to be between @c fault_t_min and @c fault_t_max.
+ *
+ *  2) Rate of change: the reading can't have moved more than @c fault_jump since the last scan that passed.
+ *     This is skipped until the channel has had its first in range reading, which is what it starts from, so a
+ *     bad reading while the reference is still settling at power up can't leave it comparing against 0.
+ *
+ *  3) Either one failing @c fault_scans scans in a row trips the channel through faultTrip().  Until then the
+ *     bad reading is just kept out of the filter, so one noisy scan can't shut a heater down for good.  The
+ *     open/shorted line check (@c fault_stuck) is done in the ADC ISR on every result, which is quicker.
+ *
+ *  Worst case latency, from a sensor going bad to its heater output going low:
+ *  - @c fault_stuck: 2 ADC scans (27 conversions of 1 ms each, so 54 ms).  One scan for the ISR to come back
+ *    around to the channel, one more if the fault landed half way through an oversampled channel.
+ *  - @c fault_range and @c fault_rate: (@c fault_scans + 1) * @c temp_ticks + 1 ADC scan (about 1.03 sec).
+ *    The scan the main loop picks up can have sampled the channel up to a scan before the last pickup, it gets
+ *    looked at on the following one, and it has to stay bad for @c fault_scans of them.
+ *  - @c fault_runaway: the heater is already off by definition, it takes @c fault_off_sec of being off and then
+ *    as long as the heater needs to climb @c fault_climb from the coolest it got.
+ *  The output goes low the moment the fault is seen, it doesn't wait on the next software PWM schedule.
+ *
+ *  @param channel    Temperature channel (index into @c saveTemps)
+ *  @param counts     Calibrated reading from this scan
+ *  @return 0 if the reading is good, otherwise the @c fault_flags bits it set
+ *  @see faultTrip
+ */
+uint8_t faultCheck(uint8_t channel, uint16_t counts)
+{
+	uint8_t flag = 0;
+	
+	if (counts < fault_lo_counts || counts > fault_hi_counts)
+		flag = fault_range;
+	else if (filt_primed & (1 << channel))      // Nothing to compare against until this channel has had one good reading
+	{
+		uint16_t moved = (counts > fault_last[channel]) ? counts - fault_last[channel] : fault_last[channel] - counts;
+		if (moved > fault_jump_counts)
+			flag = fault_rate;
+	}
+	
+	if (flag)
+	{
+		if (++fault_bad[channel] >= fault_scans)
+			faultTrip(channel, flag);
+	}
+	else
+	{
+		fault_bad[channel] = 0;
+		fault_last[channel] = counts;
+	}
+	return flag | fault_flags[channel];
+}
+
+/** @brief Latches a fault on a temperature channel and shuts its heaters off right away
+ *
+ *  Same thing the ADC ISR does for @c fault_stuck: the heater bits go into the software PWM kill masks so the
+ *  schedule can't turn them back on, and the pins are pulled low now.
+ *
+ *  @param channel    Temperature channel (index into @c saveTemps)
+ *  @param flag       @c fault_flags bit to set
+ *  @return void
+ */
+void faultTrip(uint8_t channel, uint8_t flag)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		fault_flags[channel] |= flag;
+		fault_any |= 1 << channel;
+		pwm_kill_d |= fault_bit_d[channel];
+		pwm_kill_b |= fault_bit_b[channel];
+		PORTD &= ~fault_bit_d[channel];
+		PORTB &= ~fault_bit_b[channel];
+	}
+}
+
+/** @brief Clears every latched fault and lets the heaters back on
+ *
+ *  Meant to be called from the debugger on the bench once the sensor has been fixed.  A fault that is still
+ *  there will just trip again on the next scan.
+ *
+ *  @param void
+ *  @return void
+ */
+void faultClear(void)
+{
+	uint8_t faulted;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		faulted = fault_any;
+		for (uint8_t i = 0; i < num_temps; i++)
+		{
+			fault_flags[i] = 0;
+			fault_bad[i] = 0;
+		}
+		fault_any = 0;
+		pwm_kill_d = 0;
+		pwm_kill_b = 0;
+	}
+	filt_primed &= ~faulted;                     // The channels that had faults start over from their next good reading
+}
+
+/** @brief Starts a save of the heater energy counters to EEPROM
+ *
+ *  Called when the warm-up ends, when the pump stops (or straight away with the ECU present) and every
+ *  @c energy_save_ticks from the main loop, so whatever point the vehicle gets powered down at, the counters for
+ *  every mode of the run are in EEPROM to within a minute and can be read out with avrdude.  This only takes a
+ *  snapshot, energySaveStep() writes it out a byte at a time so nothing ever waits on the EEPROM.  A save that
+ *  starts while the last one is still going just starts over with the newer numbers.
+ *
+ *  @param void
+ *  @return void
+ *  @see energySaveStep
+ */
+void energySave(void)
+{
+	energyBook(0);
+	energyBook(1);
+	memcpy(energy_snap, heater_mJ, sizeof(energy_snap));
+	energy_save_pos = 0;
+}
+
+/** @brief Writes the next byte of the energy snapshot to EEPROM, if the EEPROM is free
+ *
+ *  Called every pass of the main loop.  Returns straight away while the EEPROM is still busy with the last byte
+ *  (8.5 ms) or when there is nothing to save, otherwise it starts one byte and returns without waiting on it.
+ *  Bytes that haven't changed (most of them, only the low two of each counter move much) don't get written, so
+ *  a save is usually done in well under the 0.6 sec all 72 bytes would take.
+ *
+ *  @param void
+ *  @return void
+ *  @see energySave
+ */
+void energySaveStep(void)
+{
+	if (energy_save_pos >= sizeof(energy_snap) || !eeprom_is_ready())
+		return;
+	uint8_t pos = energy_save_pos++;
+	eeprom_update_byte((uint8_t *)ee_heater_mJ + pos, ((uint8_t *)energy_snap)[pos]);
+}
+
+/** @brief Adds the energy of the periods the timer 2 ISR has played out of one schedule to @c heater_mJ
+ *
+ *  Each period played is worth the @c pwm_energy of its schedule, so this is one 32 bit multiply and add per
+ *  heater.  It goes to the current mode and skips heaters a fault has killed.  pwmUpdate() calls it every
+ *  control step, which is about 4 periods, so the count can't wrap.
+ *
+ *  @param buf Schedule buffer, 0 or 1
+ *  @return void
+ *  @see ISR(TIMER2_COMP_vect)
+ */
+void energyBook(uint8_t buf)
+{
+	uint8_t n, kill_d, kill_b;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		n = pwm_periods[buf];
+		pwm_periods[buf] = 0;
+		kill_d = pwm_kill_d;
+		kill_b = pwm_kill_b;
+	}
+	if (!n)
+		return;
+	
+	for (uint8_t i = 0; i < num_heaters; i++)
+	{
+		if ((pwm_bit_d[i] & kill_d) | (pwm_bit_b[i] & kill_b))
+			continue;
+		uint32_t e = pwm_energy[buf][i] * n + heater_mJ_frac[i];
+		heater_mJ[(uint8_t)opMode][i] += e >> 8;
+		heater_mJ_frac[i] = (uint8_t)e;
+	}
+}
+
+/** @brief Takes care of the thermal model fits, one channel each control step
+ *
+ *  Channel i gets its sample on step i out of every @c rls_steps, so every channel is sampled every @c rls_ms
+ *  and no step has to pay for more than one rlsUpdate().  The duty for the sample is the average of what the
+ *  software PWM actually put out (after the current budget) over the sample period.
+ *
+ *  @param void
+ *  @return void
+ *  @see rlsUpdate
+ */
+void thermalModel(void)
+{
+	uint8_t i = rls_step;
+	
+	if (++rls_step >= rls_steps)
+		rls_step = 0;
+	if (i >= num_heaters)
+		return;
+	
+	int16_t e = (int16_t)rawTemps[pgm_read_byte(&heaters[i].sensor)] - (int16_t)pgm_read_word(&heaters[i].setpoint);
+	if (e > 2047)
+		e = 2047;
+	else if (e < -2047)
+		e = -2047;
+	
+	if (rls_primed & (1 << i))
+		rlsUpdate(i, e);
+	else
+		rls_primed |= 1 << i;                    // First sample only gives the starting point
+	rls_e_last[i] = e;
+	rls_u_sum[i] = 0;
+}
+
+/** @brief One recursive least squares step of a channel's thermal model
+ *
+ *  This performs the following functions:
+ *
+ *  1) Builds the regressor from the last sample, x = {e / 64, u / 256, 1} in Q12, and checks what the model
+ *     would have said @p e_now was going to be.
+ *
+ *  2) Standard exponentially weighted RLS: g = P x, k = g / (lambda + x'g), theta += k (e_now - prediction),
+ *     P = (P - k g') / lambda.  P is Q28 and all the products go through 64 bit integers, the biggest one is
+ *     about 2^58.  While the heater isn't moving the fit (sitting at full duty, say) P would keep growing by
+ *     1 / lambda, so the 1 / lambda is skipped once a diagonal gets to @c rls_p_max.
+ *
+ *  3) Works out the time constant, full duty gain and holding duty from the new fit and sets the channel's bit
+ *     in @c rls_valid if the fit makes physical sense.
+ *
+ *  About 30 64 bit multiplies and 4 64 bit divides, so somewhere around 30 ms at 1 MHz.  That's why only one
+ *  channel gets done each step.
+ *
+ *  @note While a heater only ticks over inside its dead band the temperature moves a few counts, and the count
+ *  quantization pulls a (and with it @c rls_tau and @c rls_gain) low, by about 2x in simulation.  The holding
+ *  duty @c rls_ff comes out right regardless, and that is the part the controller uses.  The time constant and
+ *  gain are best read off during the warm-up.
+ *
+ *  @param i        Row of the heater in @c heaters
+ *  @param e_now    Temperature minus setpoint in counts right now
+ *  @return void
+ *  @see thermalModel
+ */
+void rlsUpdate(uint8_t i, int16_t e_now)
+{
+	int32_t (*P)[3] = rls_P[i];
+	int32_t *theta = rls_theta[i];
+	int64_t x[3], g[3], k[3];
+	
+	x[0] = (int64_t)rls_e_last[i] << 6;
+	x[1] = (int64_t)((rls_u_sum[i] + (rls_steps >> 1)) / rls_steps) << 4;
+	x[2] = 1 << 12;
+	
+	int64_t predict = 0;
+	for (uint8_t r = 0; r < 3; r++)
+		predict += (int64_t)theta[r] * x[r];
+	int64_t err = ((int64_t)e_now << 16) - (predict >> 12);      // Q16 counts
+	
+	int64_t den = 0;
+	for (uint8_t r = 0; r < 3; r++)
+	{
+		g[r] = 0;
+		for (uint8_t c = 0; c < 3; c++)
+			g[r] += (int64_t)P[r][c] * x[c];
+		g[r] >>= 12;                                          // Back to Q28
+		den += g[r] * x[r];
+	}
+	den = rls_lambda_q28 + (den >> 12);
+	
+	for (uint8_t r = 0; r < 3; r++)
+	{
+		k[r] = (g[r] << 16) / (den >> 12);                    // Q28
+		int64_t t = theta[r] + ((k[r] * err) >> 28);
+		theta[r] = (t > INT32_MAX) ? INT32_MAX : (t < -INT32_MAX) ? -INT32_MAX : (int32_t)t;
+	}
+	
+	uint8_t inflate = 1;
+	for (uint8_t r = 0; r < 3; r++)
+		if (P[r][r] >= (int32_t)(rls_p_max * (1L << 28)))
+			inflate = 0;
+	for (uint8_t r = 0; r < 3; r++)
+	{
+		for (uint8_t c = r; c < 3; c++)
+		{
+			int64_t p = (int64_t)P[r][c] - ((k[r] * g[c]) >> 28);
+			if (inflate)
+				p = (p * rls_inv_lambda_q16) >> 16;
+			if (p > INT32_MAX)
+				p = INT32_MAX;
+			else if (p < -INT32_MAX)
+				p = -INT32_MAX;
+			P[r][c] = (int32_t)p;
+			P[c][r] = (int32_t)p;                             // Keep it symmetric, rounding would pull the halves apart
+		}
+		if (P[r][r] < 1)
+			P[r][r] = 1;
+	}
+	
+	if (rls_count[i] < 255)
+		rls_count[i]++;
+	
+	// 64 a has to be under 64 and b has to be positive for any of the rest to mean anything
+	uint8_t mask = 1 << i;
+	int32_t one_minus_a = (64L << 16) - theta[0];             // 64 (1 - a) in Q16
+	if (one_minus_a <= 0 || theta[0] <= 0 || theta[1] <= 0)
+	{
+		rls_valid &= ~mask;
+		return;
+	}
+	uint32_t tau = ((uint64_t)rls_ms << 22) / one_minus_a / 1000;                // rls_ms / (1 - a), in sec
+	uint32_t gain = ((uint64_t)theta[1] * 255 / 4) / one_minus_a;                // 255 b / (1 - a), in counts
+	int32_t ff = (int32_t)(((int64_t)-theta[2] << 8) / theta[1]);                // -c / b, in duty
+	rls_tau[i] = (tau > 0xFFFF) ? 0xFFFF : tau;
+	rls_gain[i] = (gain > 0xFFFF) ? 0xFFFF : gain;
+	rls_ff[i] = (ff < 0) ? 0 : (ff > 255) ? 255 : ff;
+	if (rls_count[i] >= rls_min_samples)
+		rls_valid |= mask;
+	else
+		rls_valid &= ~mask;
+}
+
+/** @brief One step of the fixed point PID controller for a heater
+ *
+ *  Runs every @c temp_ticks along with the rest of the heater loop, so the gains in @c pid_gains are per step
+ *  (see @c pid_gain_i and @c pid_gain_d).  The derivative acts on the measurement so a setpoint change
+ *  doesn't kick the output.  With @c pid_feedforward the thermal model's holding duty @c rls_ff is added on
+ *  once the fit is good, so the integrator only has to find the model's error instead of the whole duty.
+ *  When the fit goes good or bad (or the model's duty is 0) the feed-forward comes on or goes off in one
+ *  step, so the integrator gets moved by the difference right then and the output carries on where it was.
+ *  The output is clamped between 0 and the heater's duty for the current mode, and the integrator stops
+ *  winding up against either clamp and is held so the feed-forward plus the integrator stays inside the same range.  That way a mode
+ *  with a duty of 0 (pumping) also drains the integrator, and the heater comes back from there without a
+ *  stored kick.  Everything is in 32 bit integers, the biggest product is about 13 bits of gain times 12 bits
+ *  of error.
+ *
+ *  @param i       Row of the heater in @c heaters, picks its integrator
+ *  @param h       The heater's table entry
+ *  @param temp    Calibrated temperature in counts
+ *  @return Duty for the software PWM, 0 to 255
+ *  @see tempHeaterHelper
+ */
+uint8_t heaterPid(uint8_t i, const heater_t *h, uint16_t temp)
+{
+	int16_t err = (int16_t)h->setpoint - (int16_t)temp;
+	int32_t max = (int32_t)h->duty[(uint8_t)opMode] << pid_q;
+	int32_t ff = 0;
+	if (pid_feedforward && (rls_valid & (1 << i)))
+		ff = (int32_t)rls_ff[i] << pid_q;        // What the thermal model says holds the setpoint, the PID only has to make up the difference
+	if (ff > max)
+		ff = max;
+	int32_t integ = pid_integ[i];
+	uint8_t mask = 1 << i;
+	if ((ff ? mask : 0) ^ (pid_ff_on & mask))
+	{
+		integ += pid_ff[i] - ff;                 // Feed-forward just came on or went off, move the integrator so the output doesn't jump
+		pid_ff_on ^= mask;
+	}
+	pid_ff[i] = ff;
+	int32_t out = ff + (int32_t)pid_gains[i].kp * err + integ - (int32_t)h->kd * ((int16_t)temp - (int16_t)pid_last[i]);
+	pid_last[i] = temp;
+	
+	if (out >= max)
+	{
+		out = max;
+		if (err < 0)                             // Only let the integrator unwind while the output is pinned high
+			integ += (int32_t)pid_gains[i].ki * err;
+	}
+	else if (out <= 0)
+	{
+		out = 0;
+		if (err > 0)                             // Only let the integrator unwind while the output is pinned low
+			integ += (int32_t)pid_gains[i].ki * err;
+	}
+	else
+		integ += (int32_t)pid_gains[i].ki * err;
+	
+	if (integ > max - ff)
+		integ = max - ff;
+	else if (integ < -ff)
+		integ = -ff;
+	pid_integ[i] = integ;
+	
+	return (uint8_t)(out >> pid_q);
+}
+
+/** @brief One step of the relay autotune for a heater
+ *
+ *  Runs the Astrom-Hagglund relay experiment: the heater is switched between its mode 0 duty and off
+ *  around the setpoint (with @c tune_band of dead band) so the temperature settles into a steady
+ *  oscillation.  After @c tune_skip cycles the next @c tune_cycles are measured, peak to peak swing and
+ *  period, and turned into Ziegler-Nichols PI gains.  All of it is integer math, the only divides are the
+ *  two at the end.  The new gains go into @c pid_gains and EEPROM and the autotune moves on to the next
+ *  heater.  A heater that doesn't oscillate within @c tune_max_steps keeps the gains it had.
+ *
+ *  @param i       Row of the heater in @c heaters
+ *  @param h       The heater's table entry
+ *  @param temp    Calibrated temperature in counts
+ *  @return Duty for the software PWM, 0 to 255
+ *  @see tuneNext
+ */
+uint8_t heaterTune(uint8_t i, const heater_t *h, uint16_t temp)
+{
+	uint8_t mask = 1 << i;
+	
+	tune_steps++;
+	if (temp > tune_hi)
+		tune_hi = temp;
+	if (temp < tune_lo)
+		tune_lo = temp;
+	
+	if ((heater_state & mask) && temp > h->setpoint + tune_counts)
+	{
+		heater_state &= ~mask;
+	}
+	else if (!(heater_state & mask) && temp + tune_counts < h->setpoint)
+	{
+		heater_state |= mask;                    // The relay switching back on closes a cycle
+		if (tune_cycle > tune_skip)
+		{
+			tune_pp_sum += tune_hi - tune_lo;
+			tune_per_sum += tune_steps;
+		}
+		if (tune_cycle == tune_skip + tune_cycles)
+		{
+			uint32_t d = h->duty[0];
+			uint32_t den = (uint32_t)tune_pp_sum * tune_per_sum;
+			uint32_t kp = (d * tune_kp_k * tune_cycles + (tune_pp_sum >> 1)) / tune_pp_sum;
+			uint32_t ki = (d * tune_ki_k * tune_cycles * tune_cycles + (den >> 1)) / den;
+			
+			pid_gains[i].kp = (kp > 0xFFFE) ? 0xFFFE : kp;     // 0xFFFF would read back as "never tuned"
+			pid_gains[i].ki = (ki > 0xFFFF) ? 0xFFFF : ki;
+			pid_integ[i] = 0;
+			eeprom_update_block(&pid_gains[i], &ee_pid_gains[i], sizeof(pid_gains_t));
+			tuneNext(i + 1);
+			return 0;
+		}
+		tune_cycle++;
+		tune_steps = 0;
+		tune_hi = temp;
+		tune_lo = temp;
+	}
+	
+	if (++tune_total >= tune_max_steps)          // Never settled into an oscillation, leave its gains alone
+	{
+		tuneNext(i + 1);
+		return 0;
+	}
+	return (heater_state & mask) ? h->duty[0] : 0;
+}
+
+/** @brief Moves the autotune on to the next closed loop heater
+ *
+ *  Finds the next row of @c heaters from @p from on that has controller gains and starts its relay on.  Once
+ *  there are none left the autotune boot mode is cleared in EEPROM and the heaters go back to normal.
+ *
+ *  @param from    First row of @c heaters to look at
+ *  @return void
+ *  @see heaterTune
+ */
+void tuneNext(uint8_t from)
+{
+	heater_t h;
+	
+	for (; from < num_heaters; from++)
+	{
+		memcpy_P(&h, &heaters[from], sizeof(heater_t));
+		if (h.kp | h.ki | h.kd)
+			break;
+	}
+	if (from >= num_heaters)
+	{
+		tune_heater = tune_off;
+		eeprom_update_byte(&ee_autotune, 0);
+		return;
+	}
+	
+	tune_heater = from;
+	tune_cycle = 0;
+	tune_steps = 0;
+	tune_total = 0;
+	tune_hi = 0;
+	tune_lo = 0xFFFF;
+	tune_pp_sum = 0;
+	tune_per_sum = 0;
+	heater_state |= 1 << from;                   // Relay starts out on
+}
+
+/** @brief Works out which bit of PORTB or PORTD each heater in @c heaters drives and how much current it pulls
  *
- *  This performs the following functions:
- *  
- *  1) Reloads the TCNT1 register with 3036 (this will allow for 500ms period)
+ *  This also fills in @c fault_bit_d and @c fault_bit_b, which the ADC ISR uses to shut a heater off the moment its
+ *  sensor line goes bad, so it has to be called before interrupts are turned on.
+ *
+ *  @param void
+ *  @return void
+ *  @see pwmInit
+ */
+void pwmPins(void)
+{
+	pwm_mask_d = 0;
+	pwm_mask_b = 0;
+	for (uint8_t i = 0; i < num_temps; i++)
+	{
+		fault_bit_d[i] = 0;
+		fault_bit_b[i] = 0;
+	}
+	for (uint8_t i = 0; i < num_heaters; i++)
+	{
+		uint8_t bit = 1 << pgm_read_byte(&heaters[i].pin);
+		if ((volatile uint8_t *)pgm_read_word(&heaters[i].port) == &PORTB)
+		{
+			pwm_bit_b[i] = bit;
+			pwm_bit_d[i] = 0;
+		}
+		else
+		{
+			pwm_bit_b[i] = 0;
+			pwm_bit_d[i] = bit;
+		}
+		pwm_mask_d |= pwm_bit_d[i];
+		pwm_mask_b |= pwm_bit_b[i];
+		fault_bit_d[pgm_read_byte(&heaters[i].sensor)] |= pwm_bit_d[i];
+		fault_bit_b[pgm_read_byte(&heaters[i].sensor)] |= pwm_bit_b[i];
+		pwm_amps[i] = pgm_read_byte(&heaters[i].amps);
+	}
+}
+
+/** @brief Sets up timer 2 as the software PWM for every heater
+ *
+ *  Builds the first schedule from @c heater_duty off of the pins pwmPins() worked out, and starts timer 2 in CTC
+ *  mode with a prescalar of 256.  One period is @c pwm_period counts of 256 us, so the carrier is about 15 Hz just
+ *  like the old hardware PWMs.
  *
- *  2) Toggles the state of the state of the output pin for the LED
+ *  @param void
+ *  @return void
+ *  @see pwmUpdate
+ */
+void pwmInit(void)
+{
+	for (uint8_t i = 0; i < num_heaters; i++)
+		pwm_duty_last[i] = ~heater_duty[i];      // Make sure the first pwmUpdate() does the work
+	plan_first = plan_none;
+	pwm_first = plan_none;
+	pwm_buf = 0;
+	pwmUpdate();
+	
+	pwm_buf = 1;                                  // Play the schedule that was just built straight away
+	pwm_swap = 0;
+	pwm_seg = pwm_segs[1] - 1;                    // so the first compare match moves on to segment 0
+	TCNT2 = 0;
+	OCR2 = 0;
+	TCCR2 = (1 << WGM21);                    // CTC mode, the pins are left to PORTB/PORTD
+	TIMSK |= (1 << OCIE2);                   // turn on compare match interrupts
+	TCCR2 |= (1 << CS22) | (1 << CS21);      // This will start the timer with a prescalar of 256
+}
+
+/** @brief Total current of the heaters that are on at a point in the software PWM period
  *
- *  3) The reseting of the interrupt flag is cleared automatically (page 113 of data sheet, make sure of this)
+ *  Only counts the heaters pwmUpdate() has placed so far, the rest have an on-window of 0.
  *
- *  @param TIMER1_OVF_vect    The interrupt vector for the overflow of timer 1 
- *  @return Void
+ *  @param t    Timer 2 count into the period
+ *  @return Current in deci-amps
  */
-ISR(TIMER1_OVF_vect)
+uint16_t pwmAmpsAt(uint8_t t)
 {
-	// The LED is on PD5
-	alive_counter++;
-	if (alive_counter % 2 == 1)
-	PORTD ^= (1 << Alive_LED);
-		
-	PORTB ^= (1 << Warm_LED);   // This will have the warming LED blink 0.5 sec on 0.5 sec off and the alive LED blinking twice as slow
-		
-	// Now reset the register
-	TCNT1 = 3036;  // The interrupt will clear automatically when this function is called
+	uint16_t amps = 0;
+	for (uint8_t j = 0; j < num_heaters; j++)
+	{
+		if (pwm_wrap((uint16_t)t + pwm_period - pwm_start[j]) < pwm_len[j])
+			amps += pwm_amps[j];
+	}
+	return amps;
 }
 
-/** @brief Check for the completion of the ADC conversion, saves the result, and changes the channel
+/** @brief Works out a new software PWM schedule from @c heater_duty
  *
  *  This performs the following functions:
  *
- *  1) Check to see if the ADC has completed its conversion.  If it hasn't then return.
+ *  1) Gives every heater an on-window @c heater_duty counts long somewhere in the period, longest windows first
+ *     since they are the hardest to fit, except that the warm-up planner's @c plan_first goes ahead of them all.  The window can start at 0 or at the end of any window already placed.
+ *     For each of those starts the window is cut off at the first point where it would take the total over
+ *     @c max_amps.  The start that keeps the most of the window wins, and ties go to the lowest peak current.
+ *     So as long as the budget holds every heater gets its whole duty, and the windows get spread out instead
+ *     of all of them turning on at count 0.
  *
- *  2) Perform a 10 bit ADC read and save that to its appropriate global variable
- *  
- *  3) Changes the ADC multiplexer to the next channel in the cycle.  This
- *     means we want MUX4-0 to cycle through 00000 to 00111 (page 215)
+ *  2) Cuts the period into segments at every on and off edge and works out the port bits for each one.
  *
- *  4) Change the global variable which denotes which temperature sensor we are currently measuring on
+ *  3) Books the energy of the periods played so far through energyBook(), works out what each heater's window is
+ *     worth in energy per period, then hands the new schedule to the
+ *     ISR, which switches over at the start of its next period so no period is ever half one schedule and half
+ *     the other.
  *
- *  5) The reseting of the interrupt flag is cleared automatically
+ *  Placing the windows takes about (heaters + 1)^2 calls to pwmAmpsAt() per heater, so it is skipped when no
+ *  duty and not @c plan_first has changed.
  *
  *  @param void
  *  @return void
- *  @see tempHeaterHelper
+ *  @see pwmInit
  */
-void tempConversion(void)
+void pwmUpdate(void)
 {
-	// First check if the ADC is done converting
-	assign_bit(&ADMUX,MUX0,0);    // Assign channel to 0
-	assign_bit(&ADMUX,MUX1,0);
-	assign_bit(&ADMUX,MUX2,0);
+	uint8_t order[num_heaters];
+	uint8_t changed = 0;
+	
+	energyBook(0);                                // Book what the old schedules were worth before one gets written over
+	energyBook(1);
 	
-	for (unsigned char i = 0; i < 6; i++)
+	for (uint8_t i = 0; i < num_heaters; i++)
 	{
-		ADCSRA |= 1 << ADSC;                             // Start the conversion
-		while (!((1 << ADIF) & ADCSRA));
-		
-		while (bit_is_clear(ADCSRA, ADIF));				 // Hog execution until the ADC is done converting
-
-		// Save this as a float for the respective variable
-		uint8_t low_bits = ADCL;
-		uint8_t high_bits = ADCH;						 // Do the shifting so that there is room made inside of the 16 bit register
-		uint16_t result = (high_bits << 8) | low_bits;
-		
-		// Now I need to convert this 16 bit number into an actual temperature
-		
-		float act_temp = (float)(0.0048828125*result);   // This dumb thing converts it to a voltage
-		act_temp = act_temp*208.8 - 79.6;
-		saveTemps[i] = act_temp;
-		
-		if (i == 4){
-			assign_bit(&ADMUX, MUX1,0);
+		changed |= heater_duty[i] ^ pwm_duty_last[i];
+		pwm_duty_last[i] = heater_duty[i];
+	}
+	if (!changed && pwm_first == plan_first)
+		return;
+	pwm_first = plan_first;
+	
+	// Longest windows go first, insertion sort on the heater numbers.  The warm-up planner's pick goes ahead of all of them
+	for (uint8_t i = 0; i < num_heaters; i++)
+	{
+		uint8_t k = i;
+		while (k && order[k - 1] != plan_first && (i == plan_first || heater_duty[order[k - 1]] < heater_duty[i]))
+		{
+			order[k] = order[k - 1];
+			k--;
 		}
-		// Now update the channel the ADC is using
-		assign_bit(&ADMUX,MUX0,(i + 1) & 0x01);           // Assign bit 0
-		assign_bit(&ADMUX,MUX1,((i + 1) >> 1) & 0x01);    // Assign bit 1
-		assign_bit(&ADMUX,MUX2,((i + 1) >> 2) & 0x01);    // Assign bit 2
+		order[k] = i;
+		pwm_len[i] = 0;
+	}
+	
+	pwm_peak = 0;
+	for (uint8_t n = 0; n < num_heaters; n++)
+	{
+		uint8_t i = order[n];
+		uint8_t best_start = 0;
+		uint8_t best_len = 0;
+		uint16_t best_peak = 0xFFFF;
 		
-		if (i == 3){
-			assign_bit(&ADMUX, MUX1,1);
+		if (!heater_duty[i])
+			continue;
+		for (uint8_t c = 0; c <= num_heaters; c++)     // Candidate starts are the ends of the windows so far, and 0
+		{
+			uint8_t start = 0;
+			if (c < num_heaters)
+			{
+				if (!pwm_len[c])
+					continue;
+				start = pwm_wrap((uint16_t)pwm_start[c] + pwm_len[c]);
+			}
+			
+			// The current only steps up where another window starts, so those are the only points to check
+			uint16_t peak = pwmAmpsAt(start);
+			uint8_t fit = (peak + pwm_amps[i] > max_deci_amps) ? 0 : heater_duty[i];
+			for (uint8_t j = 0; j < num_heaters; j++)
+			{
+				uint8_t off = pwm_wrap((uint16_t)pwm_start[j] + pwm_period - start);
+				if (pwm_len[j] && off < fit && pwmAmpsAt(pwm_start[j]) + pwm_amps[i] > max_deci_amps)
+					fit = off;
+			}
+			for (uint8_t j = 0; j < num_heaters; j++)
+			{
+				uint8_t off = pwm_wrap((uint16_t)pwm_start[j] + pwm_period - start);
+				if (pwm_len[j] && off < fit)
+				{
+					uint16_t at = pwmAmpsAt(pwm_start[j]);
+					if (at > peak)
+						peak = at;
+				}
+			}
+			
+			if (fit > best_len || (fit == best_len && peak < best_peak))
+			{
+				best_start = start;
+				best_len = fit;
+				best_peak = peak;
+			}
+		}
+		pwm_start[i] = best_start;
+		pwm_len[i] = best_len;
+		if (best_len && best_peak + pwm_amps[i] > pwm_peak)
+			pwm_peak = best_peak + pwm_amps[i];
+	}
+	
+	// Every edge in the period, sorted, with no repeats
+	uint8_t edge[pwm_max_segs];
+	uint8_t segs = 1;
+	edge[0] = 0;
+	for (uint8_t i = 0; i < num_heaters; i++)
+	{
+		if (!pwm_len[i] || pwm_len[i] >= pwm_period)
+			continue;                                   // Always off or always on, no edges
+		for (uint8_t e = 0; e < 2; e++)
+		{
+			uint8_t t = e ? pwm_wrap((uint16_t)pwm_start[i] + pwm_len[i]) : pwm_start[i];
+			uint8_t k = segs;
+			while (k && edge[k - 1] > t)
+				k--;
+			if (edge[k - 1] == t)
+				continue;                               // edge[0] is 0 so k never gets down to 0
+			for (uint8_t m = segs; m > k; m--)
+				edge[m] = edge[m - 1];
+			edge[k] = t;
+			segs++;
+		}
+	}
+	
+	pwm_seg_t sched[pwm_max_segs];
+	for (uint8_t k = 0; k < segs; k++)
+	{
+		uint8_t end = (k + 1 < segs) ? edge[k + 1] : pwm_period;
+		sched[k].img_d = 0;
+		sched[k].img_b = 0;
+		sched[k].top = end - edge[k] - 1;
+		for (uint8_t i = 0; i < num_heaters; i++)
+		{
+			if (pwm_wrap((uint16_t)edge[k] + pwm_period - pwm_start[i]) < pwm_len[i])
+			{
+				sched[k].img_d |= pwm_bit_d[i];
+				sched[k].img_b |= pwm_bit_b[i];
+			}
 		}
-
-		
-		assign_bit(&ADCSRA, ADIF, 1);     // write a logical 1 to clear the flag, page 216 in the data sheet
-
 	}
-	tempHeaterHelper();             // Call the helper function.  This will serve the added bonus of killing some time so that if capacitors need to charge for the next conversion, it has the time here.  Data sheet didn't say that it needed this though.
-	if (opMode != 1)
-		_delay_ms(250);                 // Delay for 1/4 of a second.   This will only impact modes 0 and 2
 	
+	uint8_t next;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		pwm_swap = 0;                             // Call off a swap that hasn't happened yet, the ISR now stays on pwm_buf
+		next = pwm_buf ^ 0x01;
+	}
+	
+	// The ISR never looks at the other buffer until pwm_swap is set, so it can be filled in with interrupts on
+	energyBook(next);                             // Only if the ISR swapped and finished a period since the top of this
+	for (uint8_t k = 0; k < segs; k++)
+		pwm_sched[next][k] = sched[k];
+	for (uint8_t i = 0; i < num_heaters; i++)
+		pwm_energy[next][i] = (uint32_t)pwm_len[i] * pgm_read_word(&heaters[i].energy);
+	pwm_segs[next] = segs;
+	pwm_swap = 1;                                 // One byte write, the ISR picks it up at the start of its next period
 }
 
-/** @brief Checks the recorded temperatures and ensures there is no overheating
+/** @brief Interrupt Service Routine which moves the software PWM on to its next segment
  *
- *  This performs the following functions:
- *
- *  1) Compares all 6 actual temperatures with each of the desired temperatures.  If
- *     the desired temperature is reached, that heater is placed in a keep warm mode
- *
- *  2) In "keep warm" if temp falls below minimum desired, turn on heater.  If goes above maximum, turn off. 
- *  
- *  3) Once all temperatures have reached their desired temperatures, change the mode to fuel pumping
- *     and illuminate the warming complete light.
- *
- *  4) Continue the "keep warm" state after the mode has been changed.
+ *  Writes the heater bits for the new segment into PORTD and PORTB, less any that a fault has killed, and
+ *  loads OCR2 with its length.  At the end of each period it bumps the one byte count of periods played out of
+ *  that schedule, and energyBook() turns those into energy later.  At the start of a period it switches to the
+ *  other schedule if pwmUpdate() has left a new one.  This is the same handful of instructions no matter how many
+ *  heaters there are or what their duties are, so even a 1 count first segment gets its compare match in time,
+ *  and it runs at most @c pwm_max_segs times a period.
  *
- *  @param void
+ *  @param TIMER2_COMP_vect    The interrupt vector for the compare match of timer 2
  *  @return void
- *  @note Need to confirm that heater operation is still sufficient for phase 1 and 2.
- *  @see tempConversion
  */
-void tempHeaterHelper(void)
+ISR(TIMER2_COMP_vect)
 {
-	for (uint8_t i = 0; i < 6; i++)
+	uint8_t seg = pwm_seg + 1;
+	if (seg >= pwm_segs[pwm_buf])
 	{
-		switch(i){
-			case 0:                             // This is the case for the Lipo batteries   //////////////////////////////////////////////
-				if (saveTemps[0] > TempBat )    // safety first so make sure that the temperature always turns off if one of the batteries is getting too hot
-				{
-					desired_temp |= 0x01;
-					assign_bit(&PORTD, BatPin, 0);       // Turn the heater off if either of these get too high
-				}
-				else if(saveTemps[0] < TempBat)
-				{
-					assign_bit(&PORTD, BatPin, 1);    // Turn the heater back on to warm them up
-				}
-				break;
-				
-			case 1:       // This is the case for the Hopper    /////////////////////////////////////////////////
-				if (saveTemps[1] < TempHopper)           // Temp is too low so turn on the heater
-					assign_bit(&PORTD, HopperPin, 1);
-				else if(saveTemps[1] > TempHopper)
-				{
-					assign_bit(&PORTD, HopperPin, 0);    // Too hot so turn off
-					desired_temp |= 0x02;				
-				}
-				break;
-				
-			case 2:       // This is the case for the ECU  /////////////////////////////////////////////////
-				if (saveTemps[2] < TempECU){
-					if (!opMode){
-						assign_bit(&TCCR0, COM01, 1);
-						assign_bit(&TCCR0, COM00, 1);    // give the PWM its output pin back
-						assign_bit(&TCCR0, CS02, 1);      // This will turn the PWM back on
-
-					}
-					else if (opMode == 2){
-						// I need to implement the 10% DS
-						if (pwm_count == hand_pwm){
-							assign_bit(&PORTB,ECU_pin,1);   // turn it on for the one count
-						}
-						else{
-							assign_bit(&PORTB, ECU_pin,0);  // turn it off otherwise
-						}
-					}
-				}
-				else if (saveTemps[2] > TempECU)
-				{
-					if (opMode != 1)
-					{
-						assign_bit(&TCCR0, CS02, 0);      // This will turn the PWM off
-						// now force the PWM module off of the pin
-						assign_bit(&TCCR0, COM01, 0);
-						assign_bit(&TCCR0, COM00, 0);
-						assign_bit(&PORTB,ECU_pin,0);     // and force the pin low
-						desired_temp |= 0x04;
-					}
-					else{
-						assign_bit(&PORTB,ECU_pin,0);    // drive the pin low if it is too high
-					}
-				}
-				break;
-				
-			case 3:       // This is the case for Fuel Line 1  /////////////////////////////////////////////////
-				if (saveTemps[3] < TempFLine1)
-					assign_bit(&PORTD, FLine1Pin, 1);
-				else if(saveTemps[3] > TempFLine1)
-				{
-					assign_bit(&PORTD, FLine1Pin, 0);
-					desired_temp |= 0x08;
-				}
-				break;
-				
-			case 4:       // This is the case for Fuel Line 2 /////////////////////////////////////////////////
-				if (saveTemps[4] < TempFLine2){
-					if (!opMode){      // We are in the warming mode so this can use the PWM
-						// force the PWM to be on
-						assign_bit(&TCCR2, COM21, 1);
-						assign_bit(&TCCR2, COM20, 1);   // This will set it to inverting mode
-						assign_bit(&TCCR2, CS22, 1);    // this will turn the PWM on
-					}
-					else if (opMode == 2){
-						// I need to implement the 10% DS
-						if (pwm_count == hand_pwm){
-							assign_bit(&PORTD,Fline2Pin,1);   // turn it on for the one count
-						}
-						else{
-							assign_bit(&PORTD, Fline2Pin,0);  // turn it off otherwise
-						}
-					}
-				}
-				else if (saveTemps[4] > TempFLine2)
-				{
-					if (!opMode)           // We are in warming mode so this can use the PWM
-					{
-						assign_bit(&TCCR2, CS22, 0);       // Turn the PWM off
-						// now need to disconnect the port from the PWM module
-						assign_bit(&TCCR2, COM21, 0);
-						assign_bit(&TCCR2, COM20, 0);
-						assign_bit(&PORTD, Fline2Pin, 0);    // force the pin to be low
-						desired_temp |= 0x10;
-					}
-				}
-				break;
-				
-			case 5:       // This is the case for the ESB    /////////////////////////////////////////////////
-				if (saveTemps[5] < TempESB)
-					assign_bit(&PORTD, ESB_Pin, 1);
-				else if(saveTemps[5] > TempESB)
-				{
-					assign_bit(&PORTD, ESB_Pin, 0);
-					desired_temp |= 0x20;
-				}
-				break;
+		seg = 0;
+		pwm_periods[pwm_buf]++;                          // The period that just finished, energyBook() works out what it was worth
+		if (pwm_swap)
+		{
+			pwm_buf ^= 0x01;
+			pwm_swap = 0;
 		}
-		
-	}
-	
-	if (desired_temp == 0x3F)      // Will go in here every time after it stops being mode 0 this was 3F
-	{
-		/* If desired_temp was 0111 1111, it would go to 1111 1111 with the or.
-		*   Then the bitwise not (~) would make it 0000 0000.  And finally,
-		*   the logical not (!) would make it 0000 0001 and it would go into the if statement.
-		*   If desired_temp is anything but this, it will not go in here 
-		*/
-		if (!opMode)    // only do this if it has never gone in here before
-			change_timers();                     // New initialization routine which will change the prescalars and such for the timers which will be serving different purposes
 	}
+	volatile pwm_seg_t *p = &pwm_sched[pwm_buf][seg];
+	PORTD = (PORTD & ~pwm_mask_d) | (p->img_d & ~pwm_kill_d);
+	PORTB = (PORTB & ~pwm_mask_b) | (p->img_b & ~pwm_kill_b);
+	OCR2 = p->top;
+	pwm_seg = seg;
 }
 
-/** @brief Reads/times the pulse train coming from the flow meter and passes this to pumpOperation
+/** @brief Reads/times the pulse train coming from the flow meter and passes this to flowWindow
  *
  *  This performs the following functions:
  *
- *  1) Record the number of pulses that occur within an amount of time that gives to an accurate measurement
+ *  1) Check if the window in the background is done, and if not return right away.  Otherwise pick up the number of
+ *     pulses that came in during it, or with @c flow_by_period set, the time the last @c flow_edges edges took
  *
- *  2) Use the conversion factors from the flow meter's data sheet to convert this to g/sec
- *  
- *  3) Compare this against the desired flow rate and change the duty cycle on the PWM accordingly
+ *  2) Turn that into the pulses one Timer0 window would have seen so both ways feed the same control
  *
- *  4) Control the fuel flowing LED, blinking when not at the proper flow rate, steady when at the proper flow rate
+ *  3) Hand it to flowWindow, which does the conversion, the pump update, the LED and the end of run
+ *
+ *  In period mode this returns right away until there are enough edges, so the pump gets updated about every 25 ms
+ *  instead of every 262 ms.  The resolution is 1 us out of a 25 ms span instead of 1 pulse out of 170.  If the edges
+ *  stop for a whole window it is called no flow so the run still ends.
  *
- *  5) Shut the pump off when there is no more fuel to pump and turn all LED's on constant
+ *  Nothing here waits on the meter, so it gets called every pass of the main loop and the temperatures and heaters keep
+ *  going the whole time the pump runs.  The windows run back to back in hardware so no pulses get missed between them:
+ *  Timer0 times the window and its compare interrupt hands the INT2 count over (@c flow_ready is the window complete
+ *  event), or with @c flow_t0_count set, Timer0 counts the pulses itself off of T0 and the window comes off of the
+ *  timebase, timestamped the same way as the period mode edges.
+ *
+ *  When counting, the window slides.  It is @c flow_subs sub-windows of @c flow_sub_counts Timer0 counts each, held in
+ *  @c flow_ring with a running sum, so every sub-window (16 ms) the pump gets a full 262 ms worth of pulses to go off
+ *  of.  Adding the newest and taking out the oldest is the same few instructions however long the window is made.
  *
  *  @param void
  *  @return void
  *  @note Need to do a pump test to ensure that the voltage to flow rate function is actually correct.
+ *  @note With @c adc_noise_sleep the timers stop while the ADC sleeps, so the count loses those few ms.
+ *  @note ICP1 can't do the timestamping, ICR1 is TOP for the timebase and the ICP1 pin is the fuel LED.  INT2 reading
+ *        TCNT1 is the same thing with a few us of interrupt latency, which is the same for every edge so it cancels.
+ *  @see ISR(INT2_vect)
  */
 void flowMeter(void)
 {
-	// First I need to enable interrupt on INT2
-	pulse_count = 0;
-	GICR |= (1 << INT2);     // enable INT2 external interrupts
+#if flow_by_period
+	uint16_t edges, tick, tcnt, now;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		edges = flow_edges_seen;             // The ISR writes all of these, they have to be from the same edge
+		tick = flow_edge_tick;
+		tcnt = flow_edge_tcnt;
+		now = sys_ticks;
+	}
+	
+	uint16_t n = edges - flow_ref_edges;
+	if (!flow_primed && n)                   // First edge of the run (or after no flow) is where the timing starts from
+	{
+		flow_ref_edges = edges;
+		flow_ref_tick = tick;
+		flow_ref_tcnt = tcnt;
+		flow_primed = 1;
+		n = 0;
+	}
+	
+	uint16_t waited = now - flow_update_tick;
+	if ((n < flow_edges) && (waited < flow_window_ticks))
+		return;                              // Not enough edges yet, come back next pass
 	
+	float pulses = 0;
+	if (n)
+	{
+		// Timestamps are ticks * timebase_us + TCNT1, the tick difference is fine as long as it is under 65 sec
+		int32_t span = (int32_t) (uint16_t) (tick - flow_ref_tick) * timebase_us + (int32_t) tcnt - (int32_t) flow_ref_tcnt;
+		if (span > 0)
+			pulses = (float) n * window_us / (float) span;   // Mean period over the n edges, as pulses per window
+		flow_ref_edges = edges;
+		flow_ref_tick = tick;
+		flow_ref_tcnt = tcnt;
+	}
+	else
+		flow_primed = 0;                     // Nothing came in for a whole window, start fresh off the next edge
 	
-	// Second I need to begin timer0
-	TCNT0 = 0;                                 // Make sure the timer/counter register is cleared so the full range can be used
-	assign_bit(&TIFR,TOV1,1);                  // Make sure the overflow flag is set
-	assign_bit(&TCCR0,CS02,1);
-	assign_bit(&TCCR0,CS01,0);
-	assign_bit(&TCCR0,CS00,1);                 // TThis will start the timer with a prescalar of 1024
+	flow_update_tick = now;
+	flowWindow(pulses, (uint32_t) waited * timebase_us);
+#elif flow_t0_count
+	if (!tickElapsed(&flow_update_tick, flow_sub_ticks))
+		return;                              // Timer0 is still counting the sub-window in the background
 	
-	while (!(TIFR & 0x01));                    // Hog the execution until the overflow flag is set
+	uint16_t count, tick, tcnt;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		count = flowCount();                 // The count and the time it was read at have to go together
+		tcnt = TCNT1;
+		tick = sys_ticks;
+		if ((TIFR & (1 << TOV1)) && (tcnt < (timebase_top / 2)))
+			tick++;                          // Timer1 wrapped but the tick ISR hasn't counted it yet
+	}
 	
-	assign_bit(&GICR, INT2, 0);                // disable external interrupts for INT2
-	pump_count--;
+	// The main loop can get here a few ms late, so the span is what actually went by since the last read, not the window
+	int32_t span = (int32_t) (uint16_t) (tick - flow_ref_tick) * timebase_us + (int32_t) tcnt - (int32_t) flow_ref_tcnt;
+	uint16_t pulses = count - flow_ref_edges;
+	flow_ref_edges = count;
+	flow_ref_tick = tick;
+	flow_ref_tcnt = tcnt;
 	
-	int8_t pulse_error = desired_pulses - pulse_count;   // This will be able to handle negative numbers
-	measured_flow = V_per_pulse * (float) pulse_count;
-	measured_flow = measured_flow / pump_m;
-	flow_save[pump_count] = measured_flow;
-	pulse_count_array[pump_count] = pulse_count;
+	flow_sum += pulses - flow_ring[flow_head];            // Newest sub-window in, oldest out
+	flow_span_sum += span - flow_span_ring[flow_head];    // The empty slots at the start are 0 us so they don't count
+	flow_ring[flow_head] = pulses;
+	flow_span_ring[flow_head] = span;
+	if (++flow_head >= flow_subs)
+		flow_head = 0;
+	flowWindow((float) flow_sum * window_us / (float) flow_span_sum, span);
+#else
+	uint8_t subs, fill;
+	uint16_t sum;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		subs = flow_ready;                   // Normally 1, more if the main loop was held up past a sub-window
+		sum = flow_sum;
+		fill = flow_fill;
+		flow_ready = 0;
+	}
+	if (!subs)
+		return;                              // The sub-window is still going, INT2 and Timer0 do all of it in the background
+	flowWindow((float) sum * window_us / ((float) fill * flow_sub_us), subs * flow_sub_us);
+#endif
+}
 
+/** @brief Reads the 16 bit pulse count Timer0 keeps off of the T0 pin
+ *
+ *  TCNT0 is the lower byte and the overflow interrupt keeps the upper byte.  If Timer0 wrapped but its interrupt hasn't
+ *  run yet the upper byte is one short, so that gets caught off of the pending flag like the timebase does.
+ *
+ *  @param void
+ *  @return Pulses counted since pumping started, wraps at 65536 so only differences mean anything
+ *  @see ISR(TIMER0_OVF_vect)
+ */
+uint16_t flowCount(void)
+{
+	uint8_t low, high;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		low = TCNT0;
+		high = flow_t0_high;
+		if ((TIFR & (1 << TOV0)) && (low < 128))
+			high++;                          // Wrapped, the overflow interrupt just hasn't counted it yet
+	}
+	return ((uint16_t) high << 8) | low;
+}
 
+/** @brief Turns one flow measurement into the pump update, the fuel LED and the end of the run
+ *
+ *  This performs the following functions:
+ *
+ *  1) Use the conversion factors from the flow meter's data sheet to convert this to g/sec
+ *  
+ *  2) Compare this against the desired flow rate and hand the error to the flowPi() controller, along with how much
+ *     of a window the measurement covers so the loop gain doesn't change with how often it gets called
+ *
+ *  3) Every full window of pumping, log the flow and count down the startup lock and the run
+ *
+ *  4) Control the fuel flowing LED, blinking when not at the proper flow rate, steady when at the proper flow rate
+ *
+ *  5) Shut the pump off when there is no more fuel to pump
+ *
+ *  @param[in] pulses Flow as the number of pulses one Timer0 window would see
+ *  @param[in] span us of pumping this measurement covers
+ *  @return void
+ *  @see flowMeter
+ */
+void flowWindow(float pulses, uint32_t span)
+{
+	uint8_t window_done = 0;
+	if (pulses > 2047)
+		pulses = 2047;                           // Keeps the Q4 conversion in 16 bits, flowPi clamps it way below this anyway
+	int16_t err = ((int16_t) desired_pulses << flow_err_q) - (int16_t) (pulses * (1 << flow_err_q) + 0.5);   // This will be able to handle negative numbers
+	measured_flow = V_per_pulse * pulses;
+	measured_flow = measured_flow / pump_m;
+	
+	flow_elapsed += span;
+	if (flow_elapsed >= window_us)
+	{
+		flow_elapsed -= window_us;
+		window_done = 1;
+		pump_count--;
+		flow_save[pump_count] = measured_flow;
+		pulse_count_array[pump_count] = (pulses > 255) ? 255 : (uint8_t) pulses;
+	}
 	
 	if (pump_lock){     // decrease the pump lock by one. 
-		pump_lock--;
+		if (window_done)
+			pump_lock--;
 	}
 	else if ((!pump_count))                          // There is either no more fuel or there is a stoppage.  This if statement might be the end of me...
-	{
-		assign_bit(&TCCR1B, CS10, 0);          // This should stop the PWM for the pump
-		assign_bit(&TCCR1B, WGM12, 0);
-		assign_bit(&TCCR1B, WGM13, 0);
-		assign_bit(&TCCR1A, COM1B1, 0);
-		assign_bit(&TCCR1A, COM1B0, 0);
-
-
-		assign_bit(&PORTD, PD4, 0);            // This will drive the state of the pin low
-		assign_bit(&PORTD, Fuel_LED, 1);
-		TCNT2 = 60;                               // Value needed for the timer to run for 0.05 second
-		assign_bit(&PORTD, Alive_LED, 1);         // Start with turning on the LED
-		alive_counter = 0;                        // reset the hand made prescalar
-		TCCR2 = 0x06;                             // This will start the Timer with a prescalar of 256 and stop the PWM stuff
-		
-		// Now need to turn off all of the heaters real quick
-		assign_bit(&PORTD,PD0,0);
-		assign_bit(&PORTD,PD1,0);
-		assign_bit(&PORTD,PD2,0);
-		assign_bit(&PORTD,PD3,0);
-		assign_bit(&PORTD,PD7,0);
-		assign_bit(&PORTB,PB3,0);
-		
-		opMode = 2;    // this is when I can view the flow data
-		
-	}
+		pumpStop();
 	else
 	{
-		// Now I need to compare the number of pulses I got with what I should have received
-		float change = (float) pulse_error * V_per_pulse * ((float) ICR1) / pump_tot_V;   // Check page 94 in notebook for correct derivation.
-		OCR1B -= (uint16_t) (change / 3.0);   // the larger the number, the slower it is to respond, but the less overshoot it has
-		// The above line should immediately change the PWM as well
+		// How much of a window this measurement covers, in Q8, so the integral gain doesn't change with how often this runs
+		uint16_t dt = (span >= window_us) ? 256 : (uint16_t) (((span << 8) + window_us / 2) / window_us);
+		flowPi(err, dt);
 		
-		if (pulse_error < 0)
-			pulse_error = -pulse_error;          // Make it the absolute value 
-		if (pulse_error <= pulse_error_allow)    // mission is a success
+		if (!window_done)
+			return;                              // The LED only steps once a window so the blink looks the same in both modes
+		if (err < 0)
+			err = -err;                          // Make it the absolute value 
+		if (err <= ((int16_t) pulse_error_allow << flow_err_q))    // mission is a success
 			PORTD |= (1 << Fuel_LED);            // Make the fuel LED just stay on
 		else
 			PORTD ^= (1 << Fuel_LED);            // Make the fuel LED blink saying that it is not done yet.
 	}
 }
 
+/** @brief One step of the fixed point PI controller for the pump
+ *
+ *  The output is the pump's on time in Timer1 counts, clamped to 0 to @c timebase_top (ICR1), and goes out as
+ *  OCR1B = ICR1 - on time since OC1B is inverting.  The integrator only winds while the output isn't pinned, or while
+ *  the error would pull it back off of the clamp, and is held to +/- the full on time itself, so a stoppage that
+ *  pins the pump doesn't leave a stored kick behind.  The first call after the @c pump_lock startup hold loads the
+ *  integrator with whatever on time the hold left the pump at, less the P term.  The P term is at most 64 counts
+ *  (@c flow_kp times @c flow_err_max), so that always fits inside the integrator's limits and the first output is
+ *  exactly the duty the pump was already running at.
+ *
+ *  Straight line code: no loops or divides, two 16 x 16 and one 32 x 16 multiply plus a handful of 32 bit adds,
+ *  shifts and compares.  That is on the order of 300 cycles worst case, about 0.3 ms at 1 MHz, against a 16 ms
+ *  sub-window.  The error is clamped to @c flow_err_max and @p dt to one window so none of it can overflow.
+ *
+ *  @param err Flow error (desired - measured) in Q4 pulses per window
+ *  @param dt  How much of a window the measurement covers in Q8, 256 is a whole window
+ *  @return void
+ *  @see flowWindow
+ */
+void flowPi(int16_t err, uint16_t dt)
+{
+	const int32_t max = (int32_t) timebase_top << flow_q;    // ICR1, without the 16 bit read
+	if (err > flow_err_max)
+		err = flow_err_max;
+	else if (err < -flow_err_max)
+		err = -flow_err_max;
+	if (dt > 256)
+		dt = 256;
+	
+	int32_t p = ((int32_t) flow_gain(flow_kp) * err) >> flow_err_q;                  // Q8 counts
+	int32_t di = ((((int32_t) flow_gain(flow_ki) * err) >> flow_err_q) * dt) >> 8;  // Q8 counts for this dt
+	if (!flow_pi_on)
+	{
+		uint16_t hold;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			hold = OCR1B;                    // 16 bit Timer1 registers share TEMP with the ISR's TCNT1 read
+		}
+		flow_integ = ((int32_t) (timebase_top - hold) << flow_q) - p;   // Bumpless, pick up where the startup hold left off
+		flow_pi_on = 1;
+	}
+	
+	int32_t integ = flow_integ;
+	int32_t out = p + integ;
+	if (out >= max)
+	{
+		out = max;
+		if (err < 0)                             // Only let the integrator unwind while the output is pinned high
+			integ += di;
+	}
+	else if (out <= 0)
+	{
+		out = 0;
+		if (err > 0)                             // Only let the integrator unwind while the output is pinned low
+			integ += di;
+	}
+	else
+		integ += di;
+	
+	if (integ > max)
+		integ = max;
+	else if (integ < -max)
+		integ = -max;                            // Signed, the P term can need the integrator under 0 to hold the duty
+	flow_integ = integ;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		OCR1B = timebase_top - (uint16_t) (out >> flow_q);   // The PWM picks it up at the next TOP
+	}
+}
+
+/** @brief Takes the pump off, shuts the heaters down and moves on to exhaustion mode
+ *
+ *  @param void
+ *  @return void
+ *  @see flowWindow
+ */
+void pumpStop(void)
+{
+	assign_bit(&GICR, INT2, 0);            // Period mode leaves the flow meter interrupt on for the whole run
+	TCCR0 = 0;                             // Stop the Timer0 pulse count too, should it be on
+	assign_bit(&TIMSK, TOIE0, 0);
+	assign_bit(&TIMSK, OCIE0, 0);
+	assign_bit(&TCCR1A, COM1B1, 0);        // This should take the pump off of the PWM, timer1 keeps running as the timebase
+	assign_bit(&TCCR1A, COM1B0, 0);
+
+
+	assign_bit(&PORTD, PD4, 0);            // This will drive the state of the pin low
+	assign_bit(&PORTD, Fuel_LED, 1);
+	assign_bit(&PORTD, Alive_LED, 1);         // Start with turning on the LED, the tick takes care of the 0.1/0.9 sec blink
+	alive_counter = 0;                        // reset the hand made prescalar
+	
+	// Now need to turn off all of the heaters real quick
+	for (uint8_t i = 0; i < num_heaters; i++)
+		heater_duty[i] = 0;
+	pwmUpdate();
+	energySave();                          // End of the run as far as the battery is concerned
+	
+	opMode = 2;    // this is when I can view the flow data
+}
+
 /** @brief Checks if the ECU power circuit is closed and if it is not, it opens it.
  *
  *  @param[in] ECU_mode This variable denote which mode the system is configured in. 0 for dummy ECU, 1 for operational ECU
@@ -462,15 +1940,18 @@ void ECU_toggle(uint8_t ECU_mode)
  */
 void assign_bit(volatile uint8_t *sfr,uint8_t bit, uint8_t val)
 {
-	if (val)      // This is for if I want the value to be a 1
-	{
-		val = (val << bit);
-		*sfr |= val;
-	}
-	else             // This is for if I want the value to be a 0
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)     // The PWM ISR rewrites PORTB and PORTD, so the read-modify-write can't be split
 	{
-		val = ~(1 << bit);
-		*sfr &= val;
+		if (val)      // This is for if I want the value to be a 1
+		{
+			val = (1 << bit);
+			*sfr |= val;
+		}
+		else             // This is for if I want the value to be a 0
+		{
+			val = ~(1 << bit);
+			*sfr &= val;
+		}
 	}
 }
 
@@ -483,9 +1964,11 @@ void assign_bit(volatile uint8_t *sfr,uint8_t bit, uint8_t val)
  *
  *  3) Toggles the ECU to turn on (should it be present)
  *
- *  4) Sets up Timer1 to serve as the PWM controller for the flow meter
+ *  4) Connects the Timer1 output so the timebase also serves as the PWM controller for the pump
  * 
- *  5) Sets up Timer2 to command the blinking of the Alive_LED
+ *  5) Restarts the Alive_LED pattern, which the system tick takes care of
+ *
+ *  6) Saves the warm-up's heater energy to EEPROM before the pump starts
  *
  *  @param void
  *  @return void
@@ -493,133 +1976,150 @@ void assign_bit(volatile uint8_t *sfr,uint8_t bit, uint8_t val)
  */
 void change_timers(void)
 {
+	energySave();                        // Everything up to here was the warm-up
 	opMode = 1;                          // Change the operational mode
 	assign_bit(&PORTB,Warm_LED,1);    // Turn on the LED to signal the heating sequence is complete
 	pump_count = 39;   // this was 39, was 44
 	ECU_toggle(ECU_present);
 	
-	// Now need to assign timer 2 to the alive LED
+	// The alive LED patterns for modes 1 and 2 come off of the system tick
+	assign_bit(&PORTD, Alive_LED, 1);         // Start with turning on the LED
+	alive_counter = 0;                        // Reset the hand made prescalar
 	
 	if (!ECU_present)
 	{
-		// First change Timer 1 to serve as the PWM output port for the pump
-		assign_bit(&TIMSK,TOIE1,0);    // remove overflow interrupts for timer 1
-		assign_bit(&TCCR1B, CS11, 0);  // need to do this so that the prescalar will be set to 1 later
-		TCCR1A |= (1 << WGM11);     // The sets one of the bits for the mode 14 waveform
-		TCCR1B |= (1 << WGM12) | (1 << WGM13);   // This sets the other two bits for the waveform generation
-		TCCR1A |= (1 << COM1B1) | (1 << COM1B0);   // These set the output mode
-		ICR1 = 1000;     // this will set the period of oscillation to 10ms This is exactly 100 Hz on the o-scope.
+		// First hand the Timer 1 output to the pump.  Timer1 is already running in mode 14 with ICR1 = timebase_top as the timebase.
 		// This seems to cause the motor to operate smoothly even though the voltage across the pump oscillates much more
-			
 		OCR1B = ICR1 - (int)(ICR1*duty_cycle);     // This will set the count at which the PWM will change to on. Also make sure to round down to int
-		assign_bit(&TCCR1B, CS10, 1);              // This should start the PWM with a prescalar of 1
+		TCCR1A |= (1 << COM1B1) | (1 << COM1B0);   // These set the output mode, and the PWM is now on the pin
 		pump_lock = 5;                             // This should lock the pump at the starting duty for 2 second
 		// Now the PWM should be running
 			
 		// Second change Timer0 to serve as the counter for the pulse train from the flow meter
-		TCCR0 = 0;                                 // Turn off the PWM so the ECU stops being warmed
+		TCCR0 = 0;
 		assign_bit(&TCCR0,CS02,0);
 		assign_bit(&TCCR0,CS01,0);
 		assign_bit(&TCCR0,CS00,0);                 // TThis will make sure that the timer is stopped for now	
+		flow_elapsed = 0;
+		flow_pi_on = 0;
+		for (uint8_t i = 0; i < flow_subs; i++)
+		{
+			flow_ring[i] = 0;
+			flow_span_ring[i] = 0;
+		}
+		flow_sum = 0;
+		flow_span_sum = 0;
+		flow_head = 0;
+		flow_fill = 0;
+		TCNT0 = 0;
+		TIFR = 1 << TOV0;                          // Only clear TOV0, the ADC triggers off of TOV1
+#if flow_t0_count
+		// Timer0 counts the meter on its own for the whole run, normal mode clocked off of rising edges on T0 (PB0)
+		flow_t0_high = 0;
+		flow_ref_edges = 0;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			flow_update_tick = sys_ticks;          // The first window starts now
+			flow_ref_tick = sys_ticks;
+			flow_ref_tcnt = TCNT1;
+		}
+		TIMSK |= (1 << TOIE0);                     // The upper byte of the count
+		TCCR0 = (1 << CS02) | (1 << CS01) | (1 << CS00);
+#elif !flow_by_period
+		// Timer0 runs in CTC at a prescalar of 1024 for the whole run and each compare match ends one sub-window
+		pulse_count = 0;
+		flow_ready = 0;
+		OCR0 = flow_sub_counts - 1;
+		TIFR = 1 << OCF0;
+		TIMSK |= (1 << OCIE0);
+		TCCR0 = (1 << WGM01) | (1 << CS02) | (1 << CS00);
+#endif
 		
 		// Third set the MCU Control and Status Register for the Interrupt Sense Control 2
 		MCUCSR |= (1 << ISC2);                    // This will make interrupts occur on the rising edge, so the beginning of the pulse
 		
-		// Fourth set Timer2 for the 0.75/0.25 second blink of the Alive LED
-		assign_bit(&PORTD, Alive_LED, 1);         // Start with turning on the LED
-		TIMSK |= (1 << TOIE2);                    // Enable overflow interrupts on the timer
-		TCNT2 = 11;                               // This is the value needed for the timer to run for 0.25 seconds
-		alive_counter = 0;                        // Reset the hand made prescalar
-		TCCR2 = 0x07;                             // Start the timer with a prescalar of 1024
-		
-
+#if !flow_t0_count
+#if flow_by_period
+		flow_edges_seen = 0;
+		flow_ref_edges = 0;
+		flow_primed = 0;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			flow_update_tick = sys_ticks;
+		}
+#endif
+		// The meter gets counted or timestamped for the whole run, so INT2 stays on instead of being opened for each window
+		GIFR = 1 << INTF2;                        // Changing ISC2 can set the flag, so clear it before turning INT2 on
+		GICR |= (1 << INT2);
+#endif
 	}
 	else           // We are directly skipping the pumping phase so just set up the 0.1/0.9 second blink and turn on the pumping light
 	{
 		opMode = 2;                               // Change to the Exhaustion Mode
 		assign_bit(&PORTD, Fuel_LED, 1);          // turn on the fuel LED
+		energySave();                             // There is no pump stop to do it with the ECU present
 		
-		// Now I need to set up Timer2 for the Alive LED
-		TIMSK |= (1 << TOIE2);                    // Enable overflow interrupts on the timer
-		TCNT2 = 60;                               // Value needed for the timer to run for 0.05 second
-		assign_bit(&PORTD, Alive_LED, 1);         // Start with turning on the LED
-		alive_counter = 0;                        // reset the hand made prescalar
-		TCCR2 = 0x06;                             // This will start the Timer with a prescalar of 256 and stop the PWM stuff
-		
-		// now remove the other PWMS
-		TCCR0 = 0;
-		TCCR1B = 0;         // This set is to prevent any unexpected triggering of the heating circuits
-		TCCR1A = 0;
+		// Timer1 is left running as the timebase, its output was never connected.  Timer 2 keeps running the heater PWM
 		
 	}
 }
 
-/** @brief Interrupt Service Routine which reads in the pulse train and increments a count.
+#if flow_t0_count
+/** @brief Interrupt Service Routine which keeps the upper byte of the Timer0 pulse count.
+ *
+ *  Only fires every 256 pulses, which is the point of counting the meter in hardware.
+ *
+ *  @return void
+ *  @see flowCount
+ */
+ISR(TIMER0_OVF_vect)
+{
+	flow_t0_high++;
+}
+#elif !flow_by_period
+/** @brief Interrupt Service Routine for the end of each Timer0 flow sub-window
+ *
+ *  Puts the INT2 pulse count in the ring, updates the running sum and starts the next sub-window's count, so the
+ *  sub-windows are back to back and no pulses get lost even if the main loop is slow getting to them.
  *
- *  @param[in] pulse_count This is the number which describes how many pulses have been received for the sampling period.  It is an implicit argument as it is a global variable which is not explicitly passed in.
  *  @return void
  *  @see flowMeter
  */
-ISR(INT2_vect)
+ISR(TIMER0_COMP_vect)
 {
-	pulse_count++;  // The interrupt flag will automatically be cleared by hardware
+	uint8_t head = flow_head;                // Work off of copies, the globals are volatile
+	uint8_t count = pulse_count;
+	pulse_count = 0;
+	
+	flow_sum += count - flow_ring[head];     // Newest sub-window in, oldest out
+	flow_ring[head] = count;
+	if (++head >= flow_subs)
+		head = 0;
+	flow_head = head;
+	if (flow_fill < flow_subs)
+		flow_fill++;
+	flow_ready++;                            // Sub-window complete, the main loop wakes up on this interrupt and picks it up
 }
-
+#endif
 
 /** @brief Interrupt Service Routine which reads in the pulse train and increments a count.
  *
- *  This performs the following functions:
- *
- *  1) Switch to the right section of code depending on whether the code is in phase 1 or 2
+ *  With @c flow_by_period set it also timestamps the edge as the tick and TCNT1, which is a free running 1 us clock.
  *
- *  2) Compares the @p alive_counter against the preset values to attain the correct blinking pattern
- *
- *  3) Toggle the LED (where appropriate), increment alive_counter (where appropriate), and reset the timer register
- *
- *  @param[in] alive_counter Variable to act as a custom prescalar for the timer
+ *  @param[in] pulse_count This is the number which describes how many pulses have been received for the sampling period.  It is an implicit argument as it is a global variable which is not explicitly passed in.
  *  @return void
+ *  @see flowMeter
  */
-ISR(TIMER2_OVF_vect)
+ISR(INT2_vect)
 {
-	if (opMode == 1)     // Operation mode 1 so do 0.75 sec on and 0.25 sec off
-	{
-		if (alive_counter == 2)
-		{
-			assign_bit(&PORTD, Alive_LED, 0);        // Turn the LED off since it is at the end of the 0.75 sec portion
-			alive_counter++;
-			TCNT2 = 11;
-		}
-		else if (alive_counter == 3)
-		{
-			assign_bit(&PORTD, Alive_LED, 1);        // Turn the LED back on since it is about to begin the 0.75 second portion
-			alive_counter = 0;
-			TCNT2 = 11;                              // Assign the correct value into the Timer register so that it goes for 0.25 sec
-		}
-		else                                         // This section is for if it is in the middle of the 0.75 sec portion
-		{
-			alive_counter++;
-			TCNT2 = 11;
-		}
-	}
-	else   // I am in operation mode 2 so I need to do 0.1 sec on 0.9 sec off
-	{
-		if (alive_counter == 1)
-		{
-			assign_bit(&PORTD, Alive_LED, 0);            // Turn off the LED since we are at the end of the 0.1 sec period
-			alive_counter++;
-			TCNT2 = 60;
-		}
-		else if (alive_counter == 19)
-		{
-			assign_bit(&PORTD, Alive_LED, 1);            // Turn on the LED since we are at the end of the 0.9 sec period
-			alive_counter = 0;
-			TCNT2 = 60;
-
-		}
-		else
-		{
-			alive_counter++;                             // At one of the intermediate points so just keep the LED how it is
-			TCNT2 = 60; 
-		}
-	}
+	pulse_count++;  // The interrupt flag will automatically be cleared by hardware
+#if flow_by_period
+	uint16_t tcnt = TCNT1;
+	uint16_t tick = sys_ticks;
+	if ((TIFR & (1 << TOV1)) && (tcnt < (timebase_top / 2)))
+		tick++;                              // Timer1 wrapped after this ISR started, the tick ISR just hasn't counted it yet
+	flow_edge_tcnt = tcnt;
+	flow_edge_tick = tick;
+	flow_edges_seen++;
+#endif
 }
@@ -52,9 +52,228 @@
 //! Desired temperature of the ESB in degF                     (ADC6)   
 #define TempESB 10         
 
+//! Current the battery heater draws while it is on, in amps (nominal, measure these on the bench)
+#define AmpsBat 1.0
+
+//! Current the hopper heater draws while it is on, in amps
+#define AmpsHopper 2.0
+
+//! Current the ECU heater draws while it is on, in amps
+#define AmpsECU 1.5
+
+//! Current the fuel line to the pump heater draws while it is on, in amps
+#define AmpsFLine1 1.5
+
+//! Current the fuel line to the engine heater draws while it is on, in amps
+#define AmpsFLine2 1.5
+
+//! Current the ESB heater draws while it is on, in amps
+#define AmpsESB 1.0
+
+//! Rated power of the battery heater in watts (nominal, these go into the energy counters)
+#define WattsBat 7.4
+
+//! Rated power of the hopper heater in watts
+#define WattsHopper 14.8
+
+//! Rated power of the ECU heater in watts
+#define WattsECU 11.1
+
+//! Rated power of the fuel line to the pump heater in watts
+#define WattsFLine1 11.1
+
+//! Rated power of the fuel line to the engine heater in watts
+#define WattsFLine2 11.1
+
+//! Rated power of the ESB heater in watts
+#define WattsESB 7.4
+
+//! Most current all of the heaters together are allowed to draw at any instant, in amps.  Heater on-windows get cut short (down to nothing if need be) rather than go over it
+#define max_amps 10.0
+
+//! Oversampling for the battery channel.  4^n samples are averaged for n extra bits of resolution (0 to 2)
+#define OS_Bat 0
+
+//! Oversampling for the hopper channel (0 to 2)
+#define OS_Hopper 0
+
+//! Oversampling for the ECU channel (0 to 2)
+#define OS_ECU 0
+
+//! Oversampling for the fuel line to the pump channel (0 to 2)
+#define OS_FLine1 0
+
+//! Oversampling for the fuel line to the engine channel (0 to 2).  This one has the tightest tolerance so it gets the full 12 bits
+#define OS_FLine2 2
+
+//! Oversampling for the ESB channel (0 to 2)
+#define OS_ESB 0
+
+//! 1 puts the CPU in ADC Noise Reduction sleep for every conversion of a scan (timers are paused while asleep).  0 has the Timer1 overflow trigger every conversion in the background
+#define adc_noise_sleep 0
+
 //! 0 means the dummy ECU is present, 1 means the real ECU is present
 #define ECU_present 0    
 
+//! Number of temperature channels the ADC scan engine steps through.  Has to match the length of @c adc_seq in HCU_Funcs.c
+#define num_temps 6
+
+//! Turns a constant temperature in degF into the deci-degF units used by @c saveTemps and the setpoint compares (rounded)
+#define dF(T) ((int16_t)((T) * 10 + (((T) < 0) ? -0.5 : 0.5)))
+
+//! Resolution every channel's result is scaled up to, so oversampled and plain channels can be compared the same way
+#define adc_bits 12
+
+//! Number of counts in the full scale of @c adc_bits
+#define adc_full_scale (1 << adc_bits)
+
+//! Volts per count of an @c adc_bits result with AVCC (5V) as the reference
+#define adc_V_per_count (5.0 / adc_full_scale)
+
+//! Slope of the temperature sensor transfer function in degF/V
+#define temp_slope 208.8
+
+//! Y-intercept of the temperature sensor transfer function in degF
+#define temp_intercept -79.6
+
+//! Sensor gain in deci-degF per ADC count with 9 fractional bits.  Folded down by the compiler, no float makes it into the code
+#define temp_gain_q9 ((uint16_t)(adc_V_per_count * temp_slope * 10 * 512 + 0.5))
+
+//! Sensor offset in deci-degF
+#define temp_offset_dF dF(temp_intercept)
+
+//! Number of ADC counts covered by each segment of the temperature table is 2^temp_seg_shift
+#define temp_seg_shift 8
+
+//! Number of segments in the temperature table, the table itself has one more entry than this
+#define temp_seg_count (adc_full_scale >> temp_seg_shift)
+
+//! Temperature in deci-degF at the start of segment @p n.  Used to build the table in flash, single entries can be hand edited if a sensor turns out to be nonlinear
+#define temp_seg(n) dF(temp_intercept + ((n) << temp_seg_shift) * adc_V_per_count * temp_slope)
+
+//! Number of heaters.  Has to match the length of @c heaters in HCU_Funcs.c
+#define num_heaters 6
+
+//! How far below its setpoint a heater has to get before it turns back on, in degF
+#define heater_band_lo 1.0
+
+//! How far above its setpoint a heater has to get before it turns off, in degF
+#define heater_band_hi 1.0
+
+//! Fixed point shift of the heater controller gains and integrators.  A gain of 1 << pid_q is 1 duty count per count of error
+#define pid_q 8
+
+//! Turns a constant proportional or derivative gain in duty counts (out of 255) per degF into the Q8 duty per ADC count the heater table uses
+#define pid_gain(g) ((uint16_t)((g) * adc_V_per_count * temp_slope * (1 << pid_q) + 0.5))
+
+//! Turns a constant integral gain in duty counts per degF per second into the Q8 gain the heater table uses, the controller runs every @c temp_ticks
+#define pid_gain_i(g) pid_gain((g) * temp_ticks / 1000.0)
+
+//! Turns a constant derivative gain in duty counts per degF per second of change into the Q8 gain the heater table uses
+#define pid_gain_d(g) pid_gain((g) * 1000.0 / temp_ticks)
+
+//! Relay dead band for the autotune in degF.  The relay turns off this far above the setpoint and back on this far below it
+#define tune_band 0.5
+
+//! Relay cycles thrown away at the start of the autotune while the oscillation settles
+#define tune_skip 2
+
+//! Relay cycles averaged for the autotune result
+#define tune_cycles 4
+
+//! Control steps the autotune gives one heater before it gives up on it (30 minutes)
+#define tune_max_steps ((uint16_t)(1800000UL / temp_ticks))
+
+//! Value of @c tune_heater when nothing is being tuned
+#define tune_off 0xFF
+
+//! Control steps (@c temp_ticks each) between warm-up planner updates (10 sec).  The heating rates are measured over this long, a slow heater only moves a count or two in that time
+#define plan_steps 40
+
+//! EMA weight of 1/2^n the warm-up planner gives each new heating rate
+#define plan_ema_shift 3
+
+//! Value of @c warm_eta and @c plan_eta when there is no telling yet (not heating up at all), and of @c plan_first when nothing gets priority
+#define plan_none 0xFFFF
+
+//! Control steps between thermal model samples for one channel (2 sec).  The channels take turns, one per step
+#define rls_steps 8
+
+//! Forgetting factor of the thermal model fit, the last 1 / (1 - lambda) samples (50, so 100 sec) count the most
+#define rls_lambda 0.98
+
+//! Starting value of the diagonal of the thermal model's covariance matrix, how little the starting model is trusted
+#define rls_p0 1.0
+
+//! Most the diagonal of the covariance matrix is allowed to grow to while the heater isn't giving the fit anything new to go on
+#define rls_p_max 4.0
+
+//! Number of samples a channel's fit needs before the heater controller takes its feed-forward
+#define rls_min_samples 30
+
+//! 1 adds the thermal model's holding duty to the output of heaterPid().  0 leaves the model for telemetry only
+#define pid_feedforward 1
+
+//! Raw ADC results (out of @c adc_full_scale) within this many counts of either rail mean the sensor line is open or shorted
+#define fault_rail 8
+
+//! Coldest temperature a sensor can believably read in degF, anything colder is a sensor fault
+#define fault_t_min -60
+
+//! Hottest temperature a sensor can believably read in degF
+#define fault_t_max 250
+
+//! Most a channel can believably move between two scans (@c temp_ticks apart) in degF, more than that is a sensor fault
+#define fault_jump 5.0
+
+//! Number of scans in a row a reading has to be out of range or jumping before the channel trips.  A single noisy scan just gets left out of the filter
+#define fault_scans 3
+
+//! How long a heater's output has to have been off before it gets watched for running away, in sec
+#define fault_off_sec 20
+
+//! How far over its setpoint a heater has to be before it gets watched for running away, in degF
+#define fault_over 30.0
+
+//! How much a heater that is over by @c fault_over can still climb with its output off before it counts as stuck on, in degF
+#define fault_climb 10.0
+
+//! @c fault_flags bit: raw reading stuck at a rail (open or shorted line).  Set straight from the ADC ISR
+#define fault_stuck 0x01
+
+//! @c fault_flags bit: calibrated reading outside of @c fault_t_min to @c fault_t_max
+#define fault_range 0x02
+
+//! @c fault_flags bit: reading moved more than @c fault_jump in one scan
+#define fault_rate 0x04
+
+//! @c fault_flags bit: heater kept getting hotter with its output off
+#define fault_runaway 0x08
+
+//! Timer 2 counts in one software PWM period.  A duty of 255 is on for the whole period
+#define pwm_period 255
+
+//! Most segments one software PWM period can be cut into, an on and an off edge per heater plus the start of the period
+#define pwm_max_segs (2 * num_heaters + 1)
+
+//! Turns a constant current in amps into the deci-amps the heater table and the current budget use
+#define deci_amps(a) ((uint8_t)((a) * 10 + 0.5))
+
+//! Turns a constant power in watts into the energy one timer 2 count (256 us) of on-time is worth, in Q8 mJ.  Good up to 999 W
+#define watts_to_energy(w) ((uint16_t)((w) * 0.256 * 256 + 0.5))
+
+//! Ticks between saves of the heater energy counters to EEPROM (about 60 sec)
+#define energy_save_ticks 60000
+
+//! Calibration gain which means "leave the counts alone" (1.0 in Q2.14)
+#define cal_unity 16384
+
+//! Turns a constant temperature difference in degF into ADC counts (rounded), used for the heater dead bands
+#define band_to_counts(dT) ((uint16_t)((dT) / (adc_V_per_count * temp_slope) + 0.5))
+
+//! Turns a constant temperature in degF into the @c adc_bits ADC count the sensor reads at that temperature (rounded).  Folded down by the compiler so the heater compares never convert anything
+#define temp_to_counts(T) ((uint16_t)(((T) - temp_intercept) / (adc_V_per_count * temp_slope) + 0.5))
+
 
 ///////////////////////////////////////////////////////////////////////////
 ///////////////////////// Pin Assignments /////////////////////////////////
@@ -121,12 +340,166 @@
 //! Total voltage which will be sent to the pump, this should be the max seen when the pump gets a 100% duty           
 #define pump_tot_V 6.42                
 
-//! Duty cycle for the ECU heater (0.5 = 50%)
+//! TOP for Timer1, which runs the whole time as the system timebase and the pump PWM.  1000 counts at 1MHz with no prescalar is about 1 ms, and is also the ADC sample period
+#define timebase_top 1000
+
+//! 1 measures the flow from the time between flow meter edges, timestamped off of the Timer1 timebase, and updates the pump every @c flow_edges edges.  0 counts edges over one Timer0 window
+#define flow_by_period 0
+
+//! Number of flow meter edges the period gets averaged over in period mode (about 25 ms at 4.8 g/sec)
+#define flow_edges 16
+
+//! Timer1 counts (us) in one tick, the timebase counts 0 to TOP inclusive
+#define timebase_us (timebase_top + 1UL)
+
+//! Length of the Timer0 counting window in us.  Period mode still does its logging and run length in these
+#define window_us ((uint32_t)(max_time * 1000000))
+
+//! Ticks in one flow window off of the timebase.  This is how long period mode waits on @c flow_edges edges before calling it no flow
+#define flow_window_ticks ((uint16_t)(window_us / timebase_us))
+
+//! 1 has Timer0 count the flow meter pulses off of its T0 pin (PB0) so there is no interrupt per pulse, and the window gets timed off of the timebase instead.  The meter has to be wired to PB0 instead of INT2 (PB2)
+#define flow_t0_count 0
+
+#if flow_t0_count && flow_by_period
+#error "flow_t0_count and flow_by_period can't both be on, period mode needs the interrupt on every edge"
+#endif
+
+//! Number of sub-windows the sliding flow window is made of when counting.  The pump gets updated off of the last this many every time one finishes, 1 is a plain tumbling window
+#define flow_subs 16
+
+//! Length of one sub-window in Timer0 counts at a prescalar of 1024 (1.024 ms each).  The whole window is @c flow_subs of these, 16 x 16 is the same 0.262144 sec as the old Timer0 window
+#define flow_sub_counts 16
+
+//! Length of one sub-window in us
+#define flow_sub_us (flow_sub_counts * 1024UL)
+
+//! Ticks in one sub-window when Timer0 is counting the meter and the sub-windows come off of the timebase
+#define flow_sub_ticks ((uint16_t)((flow_sub_us + timebase_us / 2) / timebase_us))
+
+#if (flow_subs < 1) || (flow_subs > 255) || (flow_sub_counts < 1) || (flow_sub_counts > 256)
+#error "flow_subs has to be 1 to 255 and flow_sub_counts 1 to 256 (OCR0 is 8 bits)"
+#endif
+
+//! Timer1 counts of pump on time worth one pulse per window of flow, off of the pump's volts to flow line (about 2)
+#define flow_counts_per_pulse (pump_m * density * 1000 / (K_factor * max_time) * timebase_top / pump_tot_V)
+
+//! Proportional gain of the pump controller in Timer1 counts per pulse per window of flow error
+#define flow_kp (flow_counts_per_pulse / 4)
+
+//! Integral gain of the pump controller in Timer1 counts per pulse of error per window of time.  A third of a pulse's worth per window is the same integral action the pump always had
+#define flow_ki (flow_counts_per_pulse / 3)
+
+//! Fixed point shift of the pump controller gains and integrator.  A gain of 1 << flow_q is 1 count per pulse of error
+#define flow_q 8
+
+//! Fixed point shift of the flow error handed to the pump controller, Q4 is 1/16 of a pulse per window
+#define flow_err_q 4
+
+//! Largest flow error the pump controller takes, in Q4 pulses per window (128 pulses).  This is what keeps its products in 32 bits
+#define flow_err_max (128 << flow_err_q)
+
+//! Converts a pump controller gain to Q8
+#define flow_gain(g) ((int16_t)((g) * (1 << flow_q) + 0.5))
+
+//! Number of ticks (Timer1 periods) in one 50 ms step of the LED blink patterns
+#define ticks_per_led_step 50
+
+//! Number of LED steps in one full blink pattern (1 sec)
+#define led_steps 20
+
+//! Number of ticks between temperature updates (about 250 ms)
+#define temp_ticks 250
+
+//! Most duty the ECU heater's controller can ask for (0.5 = 50%)
 #define ECU_duty 0.5       // was 0.3 for cold test       
 
-//! Duty cycle for the second fuel line heater             
+//! Most duty the second fuel line heater's controller can ask for
 #define F_line_duty 0.2    // was 0.2 for cold test  
 
+//! ECU heater proportional gain, duty counts per degF
+#define ECU_kp 40
+
+//! ECU heater integral gain, duty counts per degF per second
+#define ECU_ki 1.0
+
+//! ECU heater derivative gain (on the measurement), duty counts per degF per second of change
+#define ECU_kd 0
+
+//! Second fuel line proportional gain, duty counts per degF
+#define FL2_kp 20
+
+//! Second fuel line integral gain, duty counts per degF per second
+#define FL2_ki 0.5
+
+//! Second fuel line derivative gain (on the measurement), duty counts per degF per second of change
+#define FL2_kd 0
+
+//! Duty cycle for the ECU and second fuel line heaters in exhaustion mode (this used to be the hand made PWM, on for 1 count out of 8)
+#define exh_duty 0.125
+
+//! Turns a constant duty cycle (0.5 = 50%) into the 8 bit duty the software PWM uses
+#define duty8(d) ((uint8_t)((d) * 255 + 0.5))
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////  Types  ///////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//! Two point calibration for one temperature channel.  Calibrated counts = ((raw * gain) >> 14) + offset
+typedef struct
+{
+	uint16_t gain;      //!< Gain in Q2.14, @c cal_unity is 1.0
+	int16_t offset;     //!< Offset in counts, applied after the gain
+} temp_cal_t;
+
+//! One step of the ADC scan sequence
+typedef struct
+{
+	uint8_t mux;        //!< Whole ADMUX value for the channel, reference bits included
+	uint8_t os_shift;   //!< Oversampling exponent, 4^n samples are averaged
+	uint8_t settle;     //!< 1 throws away the first conversion after the multiplexer switches to this channel
+} adc_chan_t;
+
+//! Filter settings for one temperature channel
+typedef struct
+{
+	uint8_t ema_shift;  //!< EMA weight of 1/2^n on each new sample, 0 turns the EMA off (0 to 4)
+	uint8_t median;     //!< 1 runs a 3 tap median ahead of the EMA to knock out single sample spikes
+} temp_filt_t;
+
+//! One segment of the software PWM period, all the heater outputs stay put for the length of it
+typedef struct
+{
+	uint8_t img_d;      //!< PORTD heater bits during the segment
+	uint8_t img_b;      //!< PORTB heater bits during the segment
+	uint8_t top;        //!< OCR2 for the segment, it lasts top + 1 timer 2 counts
+} pwm_seg_t;
+
+//! Controller gains for one heater that can be overwritten by the autotune.  Both are Q8, same as @c heater_t
+typedef struct
+{
+	uint16_t kp;        //!< Proportional gain in Q8 duty per count
+	uint16_t ki;        //!< Integral gain in Q8 duty per count per control step
+} pid_gains_t;
+
+//! Everything the heater loop needs to know about one heater.  The table of these lives in flash
+typedef struct
+{
+	volatile uint8_t *port;   //!< PORT register the heater output is on, PORTB or PORTD
+	uint16_t setpoint;        //!< Desired temperature in calibrated counts, see @c temp_to_counts
+	uint16_t hyst_lo;         //!< Counts below @c setpoint the heater turns on at
+	uint16_t hyst_hi;         //!< Counts above @c setpoint the heater turns off at
+	uint16_t kp;              //!< Proportional gain in Q8 duty per count, see @c pid_gain.  0 for kp, ki and kd runs the heater on/off.  Autotuned gains in EEPROM take over from kp and ki
+	uint16_t ki;              //!< Integral gain in Q8 duty per count per control step, see @c pid_gain_i
+	uint16_t kd;              //!< Derivative gain on the measurement in Q8 duty per count of change per control step, see @c pid_gain_d
+	uint8_t pin;              //!< Bit of @c port the heater output is on
+	uint8_t amps;             //!< Current the heater draws while it is on in deci-amps, see @c deci_amps
+	uint16_t energy;          //!< Energy one timer 2 count of on-time is worth in Q8 mJ, see @c watts_to_energy
+	uint8_t duty[3];          //!< Software PWM duty (0 to 255) while the heater is on, or the most the controller may ask for, for modes 0, 1 and 2
+	uint8_t sensor;           //!< Index into @c rawTemps of the sensor for this heater
+	uint8_t ready;            //!< Bit of @c desired_temp this heater sets once it is warm
+} heater_t;
+
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////  Functions  ///////////////////////////////
 //////////////////////////////////////////////////////////////////////////
@@ -134,10 +507,38 @@
 void Initial(void);
 void tempConversion(void);
 void tempHeaterHelper(void);
+uint8_t heaterPid(uint8_t i, const heater_t *h, uint16_t temp);
+uint8_t heaterTune(uint8_t i, const heater_t *h, uint16_t temp);
+void warmPlan(void);
+void thermalModel(void);
+void rlsUpdate(uint8_t i, int16_t e_now);
+uint8_t faultCheck(uint8_t channel, uint16_t counts);
+void faultTrip(uint8_t channel, uint8_t flag);
+void faultClear(void);
+void energySave(void);
+void energySaveStep(void);
+void energyBook(uint8_t buf);
+void tuneNext(uint8_t from);
+void pwmPins(void);
+void pwmInit(void);
+void pwmUpdate(void);
+uint16_t pwmAmpsAt(uint8_t t);
 void flowMeter(void);
+void flowWindow(float pulses, uint32_t span);
+void pumpStop(void);
+void flowPi(int16_t err, uint16_t dt);
+uint16_t flowCount(void);
 void ECU_toggle(uint8_t ECU_mode);
 void assign_bit(volatile uint8_t *sfr,uint8_t bit, uint8_t val);
 void change_timers(void);
+void adcScanStart(void);
+void adcSleepScan(void);
+uint8_t tickElapsed(uint16_t *last, uint16_t period);
+void sleepIdle(void);
+int16_t adcToTemp(uint16_t counts);
+uint16_t tempCalApply(uint8_t channel, uint16_t raw);
+uint16_t tempFilter(uint8_t channel, uint16_t counts);
+uint8_t tempCalibrate(uint8_t channel, uint16_t raw1, int16_t temp1, uint16_t raw2, int16_t temp2);
 
 
 //////////////////////////////////////////////////////////////////////////
@@ -149,12 +550,247 @@ char opMode;
 //! Value of the duty cycle in 0.XXXX
 float duty_cycle;    
 
-//! Array of the six temperatures we are keeping track of       
-float saveTemps[6]; 
+//! Array of the six temperatures we are keeping track of in deci-degF (805 is 80.5 degF).  Only for telemetry/debugging, the heaters run off of @c rawTemps
+int16_t saveTemps[num_temps]; 
+
+//! Calibrated @c adc_bits ADC counts from the latest completed scan.  tempHeaterHelper() compares these against the setpoints converted by @c temp_to_counts
+uint16_t rawTemps[num_temps];
+
+//! Two previous samples of each channel for the median filter
+uint16_t filt_hist[num_temps][2];
+
+//! EMA state for each channel, the filtered counts scaled up by 2^ema_shift
+uint16_t filt_ema[num_temps];
+
+//! Bit per channel, set once the channel's first in range reading has loaded its filter and rate check, so they don't start out from 0 counts
+uint8_t filt_primed;
+
+//! RAM copy of the per-channel calibration, loaded out of EEPROM by Initial()
+temp_cal_t temp_cal[num_temps];
+
+//! Double buffered ADC results, scaled to @c adc_bits.  The ADC ISR fills @c adc_results[adc_write_buf] while the main loop reads the other half
+volatile uint16_t adc_results[2][num_temps];
+
+//! Index of the half of @c adc_results which the ADC ISR is currently filling
+volatile uint8_t adc_write_buf;
+
+//! Index of the temperature channel the ADC is currently converting
+volatile uint8_t adc_channel;
+
+//! Running sum of the oversamples taken so far on the current channel
+volatile uint16_t adc_accum;
+
+//! Number of oversamples taken so far on the current channel
+volatile uint8_t adc_samples;
+
+//! Set when the next conversion is the dummy one after a multiplexer change and should be thrown away
+volatile uint8_t adc_discard;
+
+//! Set by the ADC ISR when a full scan has landed in the read half of @c adc_results, cleared by tempConversion()
+volatile uint8_t scan_complete;
 
 //! Byte which will flip bits 0-7 to denote when each component has reached its desired temp            
 unsigned char desired_temp;   
 
+//! Bit i is set while heater i is commanded on
+uint8_t heater_state;
+
+//! 0 until tempHeaterHelper() has set @c heater_state off of the first scan
+uint8_t heater_seeded;
+
+//! Number of times each heater has been commanded on or off, saturates at 0xFFFF.  Read these off after a bench run to see how much the outputs chatter
+uint16_t heater_switches[num_heaters];
+
+//! Commanded software PWM duty (0 to 255) for each heater.  Takes effect on the next pwmUpdate()
+uint8_t heater_duty[num_heaters];
+
+//! Integral term of each heater's controller in Q8 duty counts, held so that it plus the feed-forward stays between 0 and the mode's duty ceiling
+int32_t pid_integ[num_heaters];
+
+//! Feed-forward each heater's controller added last step in Q8 duty counts
+int32_t pid_ff[num_heaters];
+
+//! Bit i is set while heater i's controller has feed-forward on
+uint8_t pid_ff_on;
+
+//! Temperature (calibrated counts) each heater's controller saw last step, for the derivative term
+uint16_t pid_last[num_heaters];
+
+//! RAM copy of the proportional and integral gains heaterPid() runs with, from EEPROM if the heater has been autotuned and from @c heaters if not
+pid_gains_t pid_gains[num_heaters];
+
+//! Row of @c heaters the relay autotune is running on, @c tune_off for normal operation
+uint8_t tune_heater;
+
+//! Number of times the autotune relay has switched back on for the current heater
+uint8_t tune_cycle;
+
+//! Control steps since the autotune relay last switched on
+uint16_t tune_steps;
+
+//! Control steps the current heater has been tuning for, checked against @c tune_max_steps
+uint16_t tune_total;
+
+//! Hottest temperature (counts) seen in the current relay cycle
+uint16_t tune_hi;
+
+//! Coldest temperature (counts) seen in the current relay cycle
+uint16_t tune_lo;
+
+//! Peak to peak temperature swings (counts) of the averaged relay cycles added up
+uint16_t tune_pp_sum;
+
+//! Lengths (control steps) of the averaged relay cycles added up
+uint16_t tune_per_sum;
+
+//! Seconds until every heater is up to temperature, going by the slowest one.  @c plan_none until there is a rate to go on, 0 once warm.  For telemetry
+uint16_t warm_eta;
+
+//! Seconds until each heater is up to temperature, same units as @c warm_eta
+uint16_t plan_eta[num_heaters];
+
+//! Heater the warm-up planner has put first in line for current, the one with the longest time to go.  @c plan_none outside of warm-up
+uint16_t plan_first;
+
+//! Heating rate of each heater in counts per planner update, Q4 and scaled up by the EMA (2^plan_ema_shift)
+int32_t plan_rate[num_heaters];
+
+//! Temperature (counts) of each heater at the last planner update
+uint16_t plan_last[num_heaters];
+
+//! Control steps since the last planner update
+uint8_t plan_count;
+
+//! Number of planner updates so far, the ETAs aren't trusted until the rate EMA has had a few
+uint8_t plan_primed;
+
+//! @c plan_first the current software PWM schedule was worked out for
+uint16_t pwm_first;
+
+//! Thermal model of each channel, fitted by rlsUpdate().  With e the temperature minus the setpoint in counts and u the duty,
+//! e[k+1] = a e[k] + b u[k] + c every @c rls_steps.  Stored in Q16 as {64 a, 256 b, c} so all three come out about the same size
+int32_t rls_theta[num_heaters][3];
+
+//! Covariance matrix of each channel's fit in Q28
+int32_t rls_P[num_heaters][3][3];
+
+//! Temperature minus setpoint (counts) of each channel at its last sample
+int16_t rls_e_last[num_heaters];
+
+//! Duty applied to each heater added up since its last sample
+uint16_t rls_u_sum[num_heaters];
+
+//! Samples each channel's fit has had, stops at 255
+uint8_t rls_count[num_heaters];
+
+//! Control steps counted around @c rls_steps, picks whose turn it is
+uint8_t rls_step;
+
+//! Bit per heater, set once its fit has its first sample to start from
+uint8_t rls_primed;
+
+//! Bit per heater, set once its fit has had @c rls_min_samples and makes physical sense (0 < a < 1, b > 0)
+uint8_t rls_valid;
+
+//! Time constant of each channel's model in seconds, for telemetry
+uint16_t rls_tau[num_heaters];
+
+//! Steady state rise of each channel at full duty in counts, for telemetry
+uint16_t rls_gain[num_heaters];
+
+//! Duty that holds each channel right at its setpoint according to its model, the feed-forward for heaterPid()
+uint8_t rls_ff[num_heaters];
+
+//! What has gone wrong with each temperature channel, @c fault_stuck etc.  Latched until faultClear() or a reset
+volatile uint8_t fault_flags[num_temps];
+
+//! Bit per temperature channel that has a fault, the tick blinks the warming LED fast while this isn't 0
+volatile uint8_t fault_any;
+
+//! PORTD heater bits of the heaters on each temperature channel, so a fault can shut them off straight from an ISR
+uint8_t fault_bit_d[num_temps];
+
+//! PORTB heater bits of the heaters on each temperature channel
+uint8_t fault_bit_b[num_temps];
+
+//! PORTD heater bits the software PWM has to keep off no matter what the schedule says
+volatile uint8_t pwm_kill_d;
+
+//! PORTB heater bits the software PWM has to keep off no matter what the schedule says
+volatile uint8_t pwm_kill_b;
+
+//! Calibrated reading of each channel on the last scan that passed, for the @c fault_jump check
+uint16_t fault_last[num_temps];
+
+//! Number of scans in a row each channel has failed the range or rate check, trips at @c fault_scans
+uint8_t fault_bad[num_temps];
+
+//! Number of control steps each heater's output has been off, saturates at @c fault_off_steps
+uint8_t fault_off[num_heaters];
+
+//! Coolest temperature each heater has been at since it went over by @c fault_over with its output off, 0 while it isn't
+uint16_t fault_ref[num_heaters];
+
+//! Energy each heater will use over one period of each software PWM schedule in Q8 mJ, worked out by pwmUpdate()
+uint32_t pwm_energy[2][num_heaters];
+
+//! Number of periods the timer 2 ISR has played out of each schedule since energyBook() last booked them
+volatile uint8_t pwm_periods[2];
+
+//! Energy each heater has used in each mode in mJ.  Booked by energyBook(), saved to EEPROM by energySave()
+uint32_t heater_mJ[3][num_heaters];
+
+//! Fractions of a mJ left over for each heater, Q8
+uint8_t heater_mJ_frac[num_heaters];
+
+//! Copy of @c heater_mJ that energySaveStep() is writing out to EEPROM
+uint32_t energy_snap[3][num_heaters];
+
+//! Next byte of @c energy_snap to write, the size of it when there is nothing to save
+uint8_t energy_save_pos;
+
+//! Bit each heater drives in PORTD (0 if it is on PORTB), worked out from @c heaters by pwmPins()
+uint8_t pwm_bit_d[num_heaters];
+
+//! Bit each heater drives in PORTB (0 if it is on PORTD), worked out from @c heaters by pwmPins()
+uint8_t pwm_bit_b[num_heaters];
+
+//! Every heater bit in PORTD, the software PWM leaves the rest of the port alone
+uint8_t pwm_mask_d;
+
+//! Every heater bit in PORTB, the software PWM leaves the rest of the port alone
+uint8_t pwm_mask_b;
+
+//! Current each heater draws while it is on in deci-amps, copied out of @c heaters by pwmPins()
+uint8_t pwm_amps[num_heaters];
+
+//! Timer 2 count each heater's on-window starts at, picked by pwmUpdate()
+uint8_t pwm_start[num_heaters];
+
+//! Length of each heater's on-window in timer 2 counts.  This is @c heater_duty unless the current budget cut it short
+uint8_t pwm_len[num_heaters];
+
+//! Duties the schedule was last worked out for, pwmUpdate() doesn't bother if nothing changed
+uint8_t pwm_duty_last[num_heaters];
+
+//! Most current the current schedule ever draws at once, in deci-amps
+uint16_t pwm_peak;
+
+//! Software PWM schedules.  The ISR plays one while pwmUpdate() writes the other, same as @c adc_results
+volatile pwm_seg_t pwm_sched[2][pwm_max_segs];
+
+//! Number of segments in each schedule
+volatile uint8_t pwm_segs[2];
+
+//! Schedule the ISR is playing
+volatile uint8_t pwm_buf;
+
+//! Set by pwmUpdate() when the other schedule is ready, the ISR switches over at the start of the next period
+volatile uint8_t pwm_swap;
+
+//! Segment of the schedule the software PWM is on
+volatile uint8_t pwm_seg;
+
 //! Number of pulse which should be observed during the 8 bit timing window  
 uint8_t desired_pulses;    
 
@@ -164,9 +800,15 @@ uint8_t pulse_error_allow;
 //! Variable which will keep track of how many pulses were actually received    
 uint8_t pulse_count;    
 
-//! Variable to delay the alive_led so that it blinks twice as slow as the warming LED        
+//! Step (0 to @c led_steps - 1) the LED blink patterns are on        
 uint8_t alive_counter; 
 
+//! Number of ticks since the last LED step
+uint8_t blink_ticks;
+
+//! System tick, counts up once per Timer1 period (about 1 ms) and is what all the periodic work gets scheduled against
+volatile uint16_t sys_ticks;
+
 //! Variable to convert the pulses into a voltage
 float V_per_pulse;
 
@@ -184,9 +826,64 @@ float flow_save[40];
 
 //! Array saving the measured pulse counts at each iteration
 uint8_t pulse_count_array[40];
+
+//! Flow meter edges seen since pumping started (period mode), this one doesn't get reset so it is differenced instead
+volatile uint16_t flow_edges_seen;
+
+//! Tick the last flow meter edge came in on
+volatile uint16_t flow_edge_tick;
+
+//! TCNT1 at the last flow meter edge, the part of the timestamp inside the tick
+volatile uint16_t flow_edge_tcnt;
+
+//! Pulse count of each sub-window in the sliding window, oldest gets overwritten
+volatile uint16_t flow_ring[flow_subs];
+
+//! us each sub-window in @c flow_ring actually took (T0 counting, where the main loop times them)
+uint32_t flow_span_ring[flow_subs];
+
+//! Sum of @c flow_ring, kept up to date by adding the newest and taking out the oldest
+volatile uint16_t flow_sum;
+
+//! Sum of @c flow_span_ring
+uint32_t flow_span_sum;
+
+//! Slot in the rings the next sub-window goes in
+volatile uint8_t flow_head;
+
+//! How many of the ring slots have been filled since pumping started, so the first window isn't read as low flow
+volatile uint8_t flow_fill;
+
+//! Integrator of the pump controller, in Q8 Timer1 counts of pump on time
+int32_t flow_integ;
+
+//! 0 until the pump controller has taken over from the startup hold
+uint8_t flow_pi_on;
+
+//! Number of sub-windows the Timer0 compare has finished since flowMeter() last looked, this is the window complete event
+volatile uint8_t flow_ready;
+
+//! Upper byte of the Timer0 pulse count, the overflow interrupt counts it up every 256 pulses
+volatile uint8_t flow_t0_high;
+
+//! Edge (or Timer0 pulse) count the current measurement started from
+uint16_t flow_ref_edges;
+
+//! Tick of the edge (or Timer0 count read) the current measurement started from
+uint16_t flow_ref_tick;
+
+//! TCNT1 of the edge (or Timer0 count read) the current measurement started from
+uint16_t flow_ref_tcnt;
+
+//! Tick the last pump update happened on, for the no flow timeout
+uint16_t flow_update_tick;
+
+//! us of pumping since the last logging window ended
+uint32_t flow_elapsed;
+
+//! 0 until the first edge of the run has been taken as the reference
+uint8_t flow_primed;
 uint16_t output_count;
-uint8_t hand_pwm;
-uint8_t pwm_count;
 
 
 
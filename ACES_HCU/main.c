@@ -9,16 +9,23 @@
 
 int main(void)
 {
+	uint16_t temp_last = 0;      // Tick the temperatures were last updated on
+	uint16_t energy_last = 0;    // Tick the energy counters were last saved on
+	
     Initial();
     while (1) 
     {
-		output_count++;
-		tempConversion();
+		if (tickElapsed(&temp_last, temp_ticks))    // Temperatures go every 250 ms no matter the mode
+		{
+			output_count++;
+			tempConversion();
+		}
+		if (tickElapsed(&energy_last, energy_save_ticks))
+			energySave();                     // Keeps the counters in EEPROM in case the power just goes
+		energySaveStep();                     // One byte at a time, never waits on the EEPROM
 		if (!ECU_present && (opMode == 1))    // Will only go in here if the ECU is not present and in pumping mode
-			flowMeter();
-		pwm_count++;
-		if (pwm_count > hand_pwm)
-			pwm_count = 0;
+			flowMeter();                      // Returns right away unless a flow window just finished
+		sleepIdle();                          // Nothing else to do until the next tick or interrupt
     }
 }
 